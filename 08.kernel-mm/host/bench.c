@@ -0,0 +1,486 @@
+// Host driver for the memory managers: boots them on an emulated machine and
+// runs either the self tests the kernel runs at boot or a microbenchmark
+// suite.
+//
+//   mm_host check   kheap_killer, the kheap_*_test checks, slab_test, arena_test
+//   mm_host bench   throughput, scan costs and fragmentation
+//
+// Everything here is kernel code built for the host (see shim.c), so the
+// numbers compare allocator versions against each other, not against the
+// kernel running in QEMU.
+
+#include "types.h"
+#include "boot_info.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "vmalloc.h"
+#include "kheap.h"
+#include "kheap_trace.h"
+#include "slab.h"
+#include "arena.h"
+#include "ordered_array.h"
+#include "string.h"
+#include "vga.h"
+#include "host.h"
+
+// Physical memory of the emulated machine.
+#define HOST_RAM_MB 256
+#define HOST_RAM_PAGES (HOST_RAM_MB * MIB / PAGE_SIZE)
+
+static boot_info_t host_boot_info;
+
+// Objects and frames held by the benchmarks.
+static void *objs[32768];
+static uint32_t frames[HOST_RAM_PAGES];
+
+static void host_boot()
+{
+    // A PC-like memory map: low RAM, the BIOS area and everything above 1MB.
+    boot_info_t *info = &host_boot_info;
+    info->magic = BOOT_INFO_MAGIC;
+    info->e820_count = 3;
+    info->e820_map[0] = (e820_entry_t){0, 0x9F000, 1, 0};
+    info->e820_map[1] = (e820_entry_t){0xF0000, 0x10000, 2, 0};
+    info->e820_map[2] = (e820_entry_t){MIB, HOST_RAM_MB * MIB - MIB, 1, 0};
+    info->kernel_sections.kernel_phys_base = 2 * MIB;
+    info->kernel_sections.kernel_size = MIB;
+
+    pmm_init(info);
+    host_vmm_init();
+    vmalloc_init();
+    init_kheap();
+    kmem_cache_init();
+}
+
+// The kernel's rand() gets stuck on one value after a few calls, which would
+// make every "random" size the same; the benchmarks use their own generator.
+static uint32_t bench_seed = 1;
+
+static uint32_t bench_rand(uint32_t min, uint32_t max)
+{
+    bench_seed ^= bench_seed << 13;
+    bench_seed ^= bench_seed >> 17;
+    bench_seed ^= bench_seed << 5;
+    return min + bench_seed % (max - min);
+}
+
+static void report(const char *name, uint32_t ops, uint64_t nsec)
+{
+    uint32_t per_op = ops == 0 ? 0 : (uint32_t)(nsec / ops);
+    uint32_t per_sec = nsec == 0 ? 0 : (uint32_t)((uint64_t)ops * 1000000000 / nsec);
+    host_printf("  %-40s %9u ops %7u ns/op %10u ops/s\n", name, ops, per_op, per_sec);
+}
+
+static void report_heap(const char *name)
+{
+    kheap_stats_t stats;
+    kheap_drain_magazines();
+    kheap_get_stats(&stats);
+    host_printf("  %-40s heap %6uKB, in use %6uKB, holes %6uKB in %5u, largest %5uKB, frag %u.%u%%, tails %6uKB\n",
+               name, stats.heap_size / KIB, stats.in_use / KIB, stats.hole_bytes / KIB, stats.hole_count,
+               stats.largest_hole / KIB, stats.frag_permille / 10, stats.frag_permille % 10, stats.tail_bytes / KIB);
+}
+
+static void shuffle(void **array, uint32_t num)
+{
+    for (uint32_t i = num - 1; i > 0; i--)
+    {
+        uint32_t j = bench_rand(0, i + 1);
+        void *tmp = array[i];
+        array[i] = array[j];
+        array[j] = tmp;
+    }
+}
+
+// ****************************** throughput ***********************************
+static void bench_fixed_size(uint32_t size, bool_t random_order)
+{
+    const uint32_t batch = 1024;
+    const uint32_t rounds = 64;
+    uint64_t nsec = 0;
+    for (uint32_t r = 0; r < rounds; r++)
+    {
+        uint64_t start = host_nsec();
+        for (uint32_t i = 0; i < batch; i++)
+        {
+            objs[i] = kmalloc(size);
+        }
+        nsec += host_nsec() - start;
+        if (random_order)
+        {
+            shuffle(objs, batch);
+        }
+        start = host_nsec();
+        for (uint32_t i = batch; i > 0; i--)
+        {
+            kfree(objs[i - 1]);
+        }
+        nsec += host_nsec() - start;
+    }
+
+    char name[64];
+    strcpy(name, "kmalloc+kfree ");
+    uint32_t n = strlen(name);
+    for (uint32_t d = 10000; d > 0; d /= 10)
+    {
+        if (size >= d || d == 1)
+        {
+            name[n++] = '0' + (size / d) % 10;
+        }
+    }
+    strcpy(&name[n], random_order ? "B, random order" : "B, LIFO");
+    report(name, 2 * batch * rounds, nsec);
+}
+
+// A free followed by a request of the same size, between live blocks that
+// keep the freed block from merging into one big hole.
+static void bench_ping_pong(uint32_t size)
+{
+    const uint32_t ops = 100000;
+    for (uint32_t i = 0; i < 64; i++)
+    {
+        objs[i] = kmalloc(size);
+    }
+    uint64_t start = host_nsec();
+    for (uint32_t i = 0; i < ops; i++)
+    {
+        uint32_t n = i % 32 * 2;
+        kfree(objs[n]);
+        objs[n] = kmalloc(size);
+    }
+    uint64_t nsec = host_nsec() - start;
+    for (uint32_t i = 0; i < 64; i++)
+    {
+        kfree(objs[i]);
+    }
+
+    char name[64];
+    strcpy(name, "kfree+kmalloc ping-pong ");
+    uint32_t n = strlen(name);
+    for (uint32_t d = 1000; d > 0; d /= 10)
+    {
+        name[n++] = '0' + (size / d) % 10;
+    }
+    strcpy(&name[n], "B");
+    report(name, 2 * ops, nsec);
+}
+
+static void bench_atomic()
+{
+    const uint32_t ops = 100000;
+    uint64_t start = host_nsec();
+    for (uint32_t i = 0; i < ops; i++)
+    {
+        kfree_atomic(kmalloc_atomic(64));
+    }
+    report("kmalloc_atomic+kfree_atomic 64B", 2 * ops, host_nsec() - start);
+}
+
+static void bench_traces()
+{
+    kheap_trace_t trace;
+    kheap_bench_result_t result;
+    if (!kheap_trace_create(&trace, 65536))
+    {
+        host_printf("  no memory for the trace\n");
+        return;
+    }
+    for (uint32_t seed = 1; seed <= 3; seed++)
+    {
+        kheap_trace_synthetic(&trace, seed);
+        host_printf("  synthetic trace, seed %u:\n", seed);
+        if (kheap_trace_replay(&trace, &result))
+        {
+            host_set_console(true);
+            kheap_bench_print(&result);
+            host_set_console(false);
+        }
+    }
+    kheap_trace_destroy(&trace);
+}
+
+// ******************************* scan costs **********************************
+// Hold every free frame, then give back one frame in `stride`.
+static uint32_t pmm_fragment(uint32_t stride)
+{
+    uint32_t held = 0;
+    uint32_t pa;
+    while ((pa = pmm_alloc_page()) != 0)
+    {
+        frames[held++] = pa;
+    }
+    for (uint32_t i = 0; i < held; i += stride)
+    {
+        pmm_free_page(frames[i]);
+        frames[i] = 0;
+    }
+    return held;
+}
+
+static void pmm_release(uint32_t held)
+{
+    for (uint32_t i = 0; i < held; i++)
+    {
+        if (frames[i] != 0)
+        {
+            pmm_free_page(frames[i]);
+        }
+    }
+}
+
+static void bench_pmm()
+{
+    uint32_t free_before = pmm_get_free_page_count();
+
+    // Every allocation scans past 63 used frames.
+    uint32_t held = pmm_fragment(64);
+    uint32_t got[HOST_RAM_PAGES / 64 + 16];
+    uint32_t num = 0;
+    uint64_t start = host_nsec();
+    while ((got[num] = pmm_alloc_page()) != 0)
+    {
+        num++;
+    }
+    report("pmm_alloc_page, 1 in 64 frames free", num, host_nsec() - start);
+    for (uint32_t i = 0; i < num; i++)
+    {
+        pmm_free_page(got[i]);
+    }
+
+    start = host_nsec();
+    uint32_t batches = 0;
+    while (pmm_alloc_pages(&got[batches * 16], 16))
+    {
+        batches++;
+    }
+    report("pmm_alloc_pages x16, 1 in 64 frames free", batches, host_nsec() - start);
+    for (uint32_t i = 0; i < batches * 16; i++)
+    {
+        pmm_free_page(got[i]);
+    }
+
+    // No run of 16 free frames exists: each request scans the whole bitmap.
+    const uint32_t tries = 200;
+    start = host_nsec();
+    for (uint32_t i = 0; i < tries; i++)
+    {
+        uint32_t pa = pmm_alloc_contiguous(16, 1);
+        ASSERT(pa == 0);
+    }
+    report("pmm_alloc_contiguous 16, no fit", tries, host_nsec() - start);
+    pmm_release(held);
+    ASSERT(pmm_get_free_page_count() == free_before);
+}
+
+static void bench_vmalloc()
+{
+    // Single pages with every other one given back: two-page requests skip
+    // all the holes.
+    const uint32_t num = 8192;
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[i] = vmalloc_pages(1, 1);
+        ASSERT(objs[i] != NULL);
+    }
+    for (uint32_t i = 0; i < num; i += 2)
+    {
+        vfree_pages(objs[i], 1);
+    }
+
+    const uint32_t tries = 256;
+    void *got[tries];
+    uint64_t start = host_nsec();
+    for (uint32_t i = 0; i < tries; i++)
+    {
+        got[i] = vmalloc_pages(2, 1);
+        ASSERT(got[i] != NULL);
+    }
+    report("vmalloc_pages 2, 1-page holes", tries, host_nsec() - start);
+
+    for (uint32_t i = 0; i < tries; i++)
+    {
+        vfree_pages(got[i], 2);
+    }
+    for (uint32_t i = 1; i < num; i += 2)
+    {
+        vfree_pages(objs[i], 1);
+    }
+}
+
+static void bench_ordered_array()
+{
+    const uint32_t num = 4096;
+    type_t *storage = (type_t *)kmalloc(num * sizeof(type_t));
+    ordered_array_t array = ordered_array_create(storage, num, standard_comparator);
+    uint64_t start = host_nsec();
+    for (uint32_t i = 0; i < num; i++)
+    {
+        ordered_array_insert(&array, (type_t)bench_rand(0, 0xFFFFFFFF));
+    }
+    report("ordered_array_insert, 4096 entries", num, host_nsec() - start);
+
+    start = host_nsec();
+    for (uint32_t i = 0; i < num; i++)
+    {
+        ASSERT(ordered_array_find_element(&array, ordered_array_get(&array, i)) <= i);
+    }
+    report("ordered_array_find_element, 4096 entries", num, host_nsec() - start);
+    kfree(storage);
+}
+
+static void bench_heap_walks()
+{
+    const uint32_t num = 16384;
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[i] = kmalloc(bench_rand(16, 512));
+    }
+    const uint32_t tries = 100;
+    uint64_t start = host_nsec();
+    for (uint32_t i = 0; i < tries; i++)
+    {
+        kheap_validate_print(0);
+    }
+    report("kheap_validate_print, 16384 objects", tries, host_nsec() - start);
+
+    kheap_stats_t stats;
+    start = host_nsec();
+    for (uint32_t i = 0; i < tries * 100; i++)
+    {
+        kheap_get_stats(&stats);
+    }
+    report("kheap_get_stats, 16384 objects", tries * 100, host_nsec() - start);
+
+    for (uint32_t i = 0; i < num; i++)
+    {
+        kfree(objs[i]);
+    }
+}
+
+// ***************************** fragmentation *********************************
+static void frag_sawtooth()
+{
+    // Many small objects, then every other one freed.
+    const uint32_t num = 20000;
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[i] = kmalloc(bench_rand(16, 512));
+    }
+    for (uint32_t i = 0; i < num; i += 2)
+    {
+        kfree(objs[i]);
+    }
+    report_heap("sawtooth, every other freed");
+    for (uint32_t i = 1; i < num; i += 2)
+    {
+        kfree(objs[i]);
+    }
+}
+
+static void frag_growing()
+{
+    // Long-lived objects of growing size interleaved with short-lived ones:
+    // the short-lived holes are too small for the next long-lived object.
+    const uint32_t num = 4000;
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[2 * i] = kmalloc(64 + i);
+        objs[2 * i + 1] = kmalloc(bench_rand(16, 128));
+    }
+    for (uint32_t i = 0; i < num; i++)
+    {
+        kfree(objs[2 * i + 1]);
+    }
+    report_heap("growing sizes, short-lived freed");
+    for (uint32_t i = 0; i < num; i++)
+    {
+        kfree(objs[2 * i]);
+    }
+}
+
+static void frag_churn()
+{
+    // A steady live set of mixed sizes with random replacement.
+    const uint32_t live = 8192;
+    for (uint32_t i = 0; i < live; i++)
+    {
+        objs[i] = kmalloc(bench_rand(16, 2048));
+    }
+    for (uint32_t n = 0; n < 200000; n++)
+    {
+        uint32_t i = bench_rand(0, live);
+        kfree(objs[i]);
+        objs[i] = kmalloc(bench_rand(16, 2048));
+    }
+    report_heap("random churn, 8192 live");
+    for (uint32_t i = 0; i < live; i++)
+    {
+        kfree(objs[i]);
+    }
+}
+
+static void bench()
+{
+    // Keep the kernel's own messages, such as heap expansion, out of the report.
+    host_set_console(false);
+    host_printf("throughput:\n");
+    uint32_t sizes[] = {16, 64, 256, 1024, 4096};
+    for (uint32_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        bench_fixed_size(sizes[i], false);
+        bench_fixed_size(sizes[i], true);
+    }
+    bench_ping_pong(1000);
+    bench_ping_pong(3000);
+    bench_atomic();
+    bench_traces();
+
+    host_printf("scan costs:\n");
+    bench_pmm();
+    bench_vmalloc();
+    bench_ordered_array();
+    bench_heap_walks();
+
+    host_printf("fragmentation:\n");
+    frag_sawtooth();
+    frag_growing();
+    frag_churn();
+    report_heap("after freeing everything");
+    host_printf("page faults %u (%u zero page), frames free %u of %u\n", host_page_faults(), host_zero_faults(),
+               pmm_get_free_page_count(), HOST_RAM_PAGES);
+}
+
+static void check()
+{
+    kheap_killer();
+    kheap_realloc_test();
+    kheap_quick_test();
+    kheap_align_test();
+    kheap_contract_test();
+    kheap_zero_test();
+    kheap_arena_test();
+    kheap_large_test();
+    kheap_atomic_test();
+    kheap_stats_test();
+    slab_test();
+    arena_test();
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2 || (strcmp(argv[1], "check") != 0 && strcmp(argv[1], "bench") != 0))
+    {
+        host_printf("usage: %s check|bench\n", argv[0]);
+        return 2;
+    }
+    host_boot();
+    if (strcmp(argv[1], "check") == 0)
+    {
+        check();
+    }
+    else
+    {
+        bench();
+    }
+    return 0;
+}
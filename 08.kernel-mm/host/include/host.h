@@ -0,0 +1,23 @@
+#ifndef HOST_H
+#define HOST_H
+
+#include "types.h"
+
+// Services of the host shim (shim.c) that the kernel does not have.
+
+// Start emulating paging: the zero page is taken from the PMM, which must be
+// initialised, and faults in registered regions are handled from now on.
+void host_vmm_init(void);
+
+// printf that always reaches stdout; the kernel's vga_printf can be muted.
+void host_printf(const char *fmt, ...);
+void host_set_console(bool_t on);
+
+// Monotonic time in nanoseconds.
+uint64_t host_nsec(void);
+
+// Page faults handled so far, and how many of them mapped the zero page.
+uint32_t host_page_faults(void);
+uint32_t host_zero_faults(void);
+
+#endif // HOST_H
@@ -0,0 +1,27 @@
+#ifndef _KERNEL_H
+#define _KERNEL_H
+
+// Host build of kernel.h: a panic reports where it happened and aborts the
+// process instead of halting the CPU.
+
+#include "types.h"
+#include "vga.h"
+
+__attribute__((noreturn)) void host_panic(const char *file, const char *func, int line);
+
+#define PANIC() host_panic(__FILE__, __FUNCTION__, __LINE__)
+
+#ifdef NDEBUG
+#define ASSERT(CONDITION) ((void)0)
+#else
+#define ASSERT(CONDITION) \
+    if (CONDITION)        \
+    {                     \
+    }                     \
+    else                  \
+    {                     \
+        PANIC();          \
+    }
+#endif // NDEBUG
+
+#endif // _KERNEL_H
@@ -0,0 +1,8 @@
+#ifndef HOST_STDINT_H
+#define HOST_STDINT_H
+
+// Kernel code gets its fixed-width types from types.h; the host's stdint.h
+// would define uint64_t differently and clash with it.
+#include "types.h"
+
+#endif // HOST_STDINT_H
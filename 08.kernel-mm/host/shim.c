@@ -0,0 +1,323 @@
+// Host implementations of the kernel services the memory managers use.
+//
+// This file is built against the host C library and must not include kernel
+// headers, whose types clash with libc; the prototypes here mirror the
+// kernel's. Paging is emulated: a registered region is reserved with mmap at
+// its kernel address and starts inaccessible, a flat page table records which
+// PMM frame backs each page, and a SIGSEGV handler plays the page-fault
+// handler for anonymous regions. The heap therefore faults, grows and shrinks
+// through the real PMM, as it does in the kernel.
+
+#define _GNU_SOURCE
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// Must match vmm.h and timer.h.
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+#define PAGE_PRESENT (1 << 0)
+#define PAGE_RW (1 << 1)
+#define VMM_REGION_ANON (1 << 0)
+#define VMM_MAX_REGIONS 8
+#define TIMER_FREQUENCY 50
+
+// Bit of the page-fault error code set for write accesses.
+#define PF_WRITE (1 << 1)
+
+uint32_t pmm_alloc_page(void);
+void pmm_free_page(uint32_t paddr);
+
+// ********************************* services **********************************
+void host_panic(const char *file, const char *func, int line)
+{
+    fflush(stdout);
+    fprintf(stderr, "KERNEL PANIC at %s, %s(), line %d\n", file, func, line);
+    abort();
+}
+
+static bool console = true;
+
+// The kernel prints %p as a 32-bit value, which host printf would read as a
+// 64-bit one.
+static void host_vprintf(const char *fmt, va_list args)
+{
+    char host_fmt[512];
+    uint32_t n = 0;
+    for (const char *p = fmt; *p != '\0' && n + 6 < sizeof(host_fmt); p++)
+    {
+        if (p[0] == '%' && p[1] == 'p')
+        {
+            memcpy(&host_fmt[n], "0x%08x", 6);
+            n += 6;
+            p++;
+            continue;
+        }
+        host_fmt[n++] = *p;
+    }
+    host_fmt[n] = '\0';
+    vprintf(host_fmt, args);
+}
+
+void host_printf(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    host_vprintf(fmt, args);
+    va_end(args);
+}
+
+void host_set_console(bool on)
+{
+    console = on;
+}
+
+void vga_printf(const char *fmt, ...)
+{
+    if (!console)
+    {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    host_vprintf(fmt, args);
+    va_end(args);
+}
+
+uint64_t host_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t getTick(void)
+{
+    return (uint32_t)(host_nsec() / (1000000000 / TIMER_FREQUENCY));
+}
+
+uint32_t atomic_exchange(volatile uint32_t *ptr, uint32_t val)
+{
+    return __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST);
+}
+
+uint32_t atomic_inc(volatile uint32_t *ptr)
+{
+    return __atomic_add_fetch(ptr, 1, __ATOMIC_SEQ_CST);
+}
+
+// There are no interrupts to disable in a host process.
+uint32_t cpu_save_flags_and_cli(void)
+{
+    return 0;
+}
+
+void set_eflags(uint32_t eflags)
+{
+    (void)eflags;
+}
+
+// ********************************** paging ***********************************
+typedef struct host_region
+{
+    const char *name;
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;
+} host_region_t;
+
+static host_region_t regions[VMM_MAX_REGIONS];
+static uint32_t region_count;
+
+// One entry per 4KB page of the 32-bit address space: frame | PAGE_* flags.
+static uint32_t ptes[1 << (32 - PAGE_SHIFT)];
+static uint32_t zero_frame;
+static uint32_t page_faults;
+static uint32_t zero_faults;
+
+static host_region_t *region_find(uintptr_t addr)
+{
+    for (uint32_t i = 0; i < region_count; i++)
+    {
+        if (addr >= regions[i].start && addr < regions[i].end)
+        {
+            return &regions[i];
+        }
+    }
+    return NULL;
+}
+
+static void page_protect(uint32_t va, int prot)
+{
+    if (mprotect((void *)(uintptr_t)va, PAGE_SIZE, prot) != 0)
+    {
+        perror("mprotect");
+        abort();
+    }
+}
+
+static void map_page(uint32_t va, uint32_t pa, uint32_t flags)
+{
+    ptes[va >> PAGE_SHIFT] = (pa & ~(PAGE_SIZE - 1)) | (flags & (PAGE_SIZE - 1)) | PAGE_PRESENT;
+    page_protect(va, (flags & PAGE_RW) ? PROT_READ | PROT_WRITE : PROT_READ);
+}
+
+bool vmm_region_register(const char *name, uint32_t start, uint32_t end, uint32_t flags)
+{
+    if ((start & (PAGE_SIZE - 1)) != 0 || (end & (PAGE_SIZE - 1)) != 0 || start >= end ||
+        region_count == VMM_MAX_REGIONS)
+    {
+        return false;
+    }
+    void *addr = mmap((void *)(uintptr_t)start, end - start, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if (addr != (void *)(uintptr_t)start)
+    {
+        fprintf(stderr, "cannot reserve region %s at 0x%08x\n", name, start);
+        return false;
+    }
+    host_region_t *region = &regions[region_count++];
+    region->name = name;
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    return true;
+}
+
+bool vmm_map_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
+{
+    map_page(virt_addr & ~(PAGE_SIZE - 1), phys_addr, flags);
+    return true;
+}
+
+bool vmm_map_range(uint32_t virt_addr, const uint32_t *frames, uint32_t count, uint32_t flags)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        map_page(virt_addr + i * PAGE_SIZE, frames[i], flags);
+    }
+    return true;
+}
+
+bool vmm_alloc_and_map_page(uint32_t virt_addr, uint32_t flags)
+{
+    uint32_t pa = pmm_alloc_page();
+    if (pa == 0)
+    {
+        return false;
+    }
+    map_page(virt_addr & ~(PAGE_SIZE - 1), pa, flags);
+    return true;
+}
+
+// The host page is discarded as well, so a frame mapped again later does not
+// keep its contents as it would in the kernel; callers free the frame anyway.
+void vmm_unmap_page(uint32_t virt_addr)
+{
+    uint32_t va = virt_addr & ~(PAGE_SIZE - 1);
+    ptes[va >> PAGE_SHIFT] = 0;
+    madvise((void *)(uintptr_t)va, PAGE_SIZE, MADV_DONTNEED);
+    page_protect(va, PROT_NONE);
+}
+
+uint32_t vmm_get_phys_addr(uint32_t virt_addr)
+{
+    uint32_t pte = ptes[virt_addr >> PAGE_SHIFT];
+    return (pte & PAGE_PRESENT) ? (pte & ~(PAGE_SIZE - 1)) | (virt_addr & (PAGE_SIZE - 1)) : 0;
+}
+
+uint32_t vmm_release_range(uint32_t virt_addr, uint32_t pages)
+{
+    uint32_t released = 0;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        uint32_t va = virt_addr + i * PAGE_SIZE;
+        uint32_t pa = vmm_get_phys_addr(va);
+        if (pa == 0)
+        {
+            continue;
+        }
+        vmm_unmap_page(va);
+        if ((pa & ~(PAGE_SIZE - 1)) != zero_frame)
+        {
+            pmm_free_page(pa & ~(PAGE_SIZE - 1));
+            released++;
+        }
+    }
+    return released;
+}
+
+uint32_t vmm_zero_page_phys(void)
+{
+    return zero_frame;
+}
+
+// Demand paging for anonymous regions, as in the kernel: a read maps the
+// shared zero page read-only, a write maps a fresh frame. Any other fault is
+// a real bug and gets the default action.
+static void page_fault(int sig, siginfo_t *info, void *context)
+{
+    uintptr_t addr = (uintptr_t)info->si_addr;
+    bool is_write = (((ucontext_t *)context)->uc_mcontext.gregs[REG_ERR] & PF_WRITE) != 0;
+    host_region_t *region = addr < 0x100000000ULL ? region_find(addr) : NULL;
+    uint32_t va = (uint32_t)addr & ~(PAGE_SIZE - 1);
+    uint32_t pte = ptes[va >> PAGE_SHIFT];
+    bool on_zero_page = (pte & PAGE_PRESENT) && (pte & ~(PAGE_SIZE - 1)) == zero_frame;
+    if (region == NULL || !(region->flags & VMM_REGION_ANON) || ((pte & PAGE_PRESENT) && !on_zero_page))
+    {
+        fprintf(stderr, "unhandled page fault at 0x%lx (%s)\n", (unsigned long)addr, is_write ? "write" : "read");
+        signal(sig, SIG_DFL);
+        return;
+    }
+
+    page_faults++;
+    if (!is_write)
+    {
+        zero_faults++;
+        map_page(va, zero_frame, PAGE_PRESENT);
+        return;
+    }
+    uint32_t pa = pmm_alloc_page();
+    if (pa == 0)
+    {
+        static const char msg[] = "page fault: out of physical memory\n";
+        write(STDERR_FILENO, msg, sizeof(msg) - 1);
+        abort();
+    }
+    map_page(va, pa, PAGE_PRESENT | PAGE_RW);
+}
+
+void host_vmm_init(void)
+{
+    zero_frame = pmm_alloc_page();
+    if (zero_frame == 0)
+    {
+        fprintf(stderr, "no frame for the zero page\n");
+        abort();
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = page_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, NULL);
+}
+
+uint32_t host_page_faults(void)
+{
+    return page_faults;
+}
+
+uint32_t host_zero_faults(void)
+{
+    return zero_faults;
+}
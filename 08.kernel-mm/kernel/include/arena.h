@@ -0,0 +1,75 @@
+/**
+ * @file arena.h
+ * @brief 区域（arena）分配器接口
+ *
+ * 适合"大量小对象一起分配、一起释放"的场景（启动期解析、为新地址空间建页表、
+ * 一次 I/O 请求等）：
+ * - 内存以 chunk 为单位从 vmalloc 取得，chunk 内按指针递增（bump）分配；
+ * - 对象没有任何头部元数据，也不能单独释放；
+ * - arena_reset() 以 O(1) 一次性释放全部对象，chunk 保留下来供之后复用；
+ * - arena_destroy() 把所有 chunk 归还给 vmalloc。
+ *
+ * arena 描述符放在第一个 chunk 的开头。arena 本身不加锁，由使用者保证同一时刻
+ * 只有一个执行流在使用它。
+ *
+ * 注意：这里的 arena 与 kheap 按 CPU 划分的堆 arena（KHEAP_ARENA_*）无关。
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "types.h"
+
+/**
+ * @brief arena_alloc() 返回地址的对齐（与 kmalloc 相同）
+ */
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk
+{
+    struct arena_chunk *next;
+    uint32_t pages;
+} arena_chunk_t;
+
+typedef struct arena
+{
+    arena_chunk_t *first;   /**< 第一个 chunk，描述符就位于其中 */
+    arena_chunk_t *current; /**< 正在分配的 chunk */
+    uint32_t cur;           /**< 下一次分配的起始地址 */
+    uint32_t end;           /**< current 的结束地址 */
+    uint32_t chunk_pages;   /**< 新 chunk 的默认页数 */
+    uint32_t chunks;        /**< 持有的 chunk 数 */
+    uint32_t used;          /**< 自创建或上次 reset 以来分配的字节数 */
+} arena_t;
+
+// ****************************************************************************
+/**
+ * @brief 创建一个 arena
+ *
+ * @param chunk_pages 每个 chunk 的页数；更大的请求会得到单独的、足够大的 chunk
+ * @return arena_t* 新 arena；内存耗尽时返回 NULL
+ */
+arena_t *arena_create(uint32_t chunk_pages);
+
+/**
+ * @brief 从 arena 分配 size 字节，按 ARENA_ALIGN 对齐
+ *
+ * @return void* 分配的内存（内容未定义）；size 为 0、过大或内存耗尽时返回 NULL
+ */
+void *arena_alloc(arena_t *arena, uint32_t size);
+
+/**
+ * @brief 一次性释放 arena 中的全部对象，O(1)
+ * @note 所有 chunk 都保留，之后的分配依次复用它们。
+ */
+void arena_reset(arena_t *arena);
+
+/**
+ * @brief 销毁 arena，归还全部 chunk（包括描述符所在的第一个）
+ */
+void arena_destroy(arena_t *arena);
+
+// ******************************** unit tests **********************************
+void arena_test();
+
+#endif // ARENA_H
@@ -0,0 +1,33 @@
+#ifndef CPU_H
+#define CPU_H
+
+#include "types.h"
+
+/**
+ * @brief 内核支持的最大 CPU 数
+ * @note 目前只启动 BSP 一个 CPU；按 CPU 划分的数据结构按此上限静态分配，
+ *       将来启动 AP 时无需修改其布局。
+ */
+#define NR_CPUS 4
+
+/**
+ * @brief 获取当前 CPU 的编号 [0, NR_CPUS)
+ * @note 单核阶段恒为 0。支持多核后应改为读取 LAPIC ID 或 per-CPU 段寄存器。
+ */
+static inline uint32_t smp_processor_id(void)
+{
+    return 0;
+}
+
+/**
+ * @brief 读取时间戳计数器（TSC）
+ * @note 只用于测量时间间隔；TSC 的频率需要先用定时器标定。
+ */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#endif // CPU_H
@@ -2,41 +2,232 @@
 #define KHEAP_H
 
 #include "types.h"
-#include "ordered_array.h"
+#include "yieldlock.h"
 
 #define KHEAP_START 0xC0C00000
 #define KHEAP_MIN_SIZE 0x300000
 #define KHEAP_MAX 0xE0000000
 
-#define KHEAP_INDEX_NUM 0x20000
-#define KHEAP_MAGIC 0x12345678
+// The heap range is split into KHEAP_ARENA_COUNT arenas, each a separate heap
+// with its own locks, free lists and magazine depots over a disjoint
+// KHEAP_ARENA_SPAN slice. The arena of a block follows from its address, so a
+// block can be freed from any CPU. CPUs are bound to arena cpu % count by default.
+#define KHEAP_ARENA_COUNT 4
+#define KHEAP_ARENA_SPAN (((KHEAP_MAX - KHEAP_START) / KHEAP_ARENA_COUNT) & 0xFFFFF000)
 
-// 9 bytes
+// Every payload the heap hands out is aligned to KHEAP_ALIGN bytes, so 64-bit
+// and SIMD fields inside allocations are never misaligned.
+#define KHEAP_ALIGN 16
+
+// When the hole at the end of the heap grows past KHEAP_CONTRACT_THRESHOLD,
+// the heap is shrunk so that only KHEAP_CONTRACT_KEEP bytes of it remain, and
+// the trailing pages are given back to the PMM. That only happens once the
+// heap has not grown for KHEAP_CONTRACT_DELAY ticks: a workload that keeps
+// growing and shrinking reuses its tail instead of faulting it in each time.
+// kheap_reclaim() trims tails that went idle after their last free.
+#define KHEAP_CONTRACT_THRESHOLD 0x80000
+#define KHEAP_CONTRACT_KEEP 0x20000
+#define KHEAP_CONTRACT_DELAY 100
+
+// Growths up to this many pages are backed eagerly: frames are taken from the
+// PMM in one batch and mapped with a single TLB flush. Larger growths stay
+// lazy and are backed page by page on first touch.
+#define KHEAP_EAGER_MAX_PAGES 256
+
+// Per-CPU magazine caches (Bonwick) sit in front of the heap for small sizes.
+// Requests up to KHEAP_MAG_MAX_SIZE are rounded up to one of the power-of-two
+// classes 16, 32, ..., 512 bytes. Each CPU keeps a loaded and a previous
+// magazine of KHEAP_MAG_ROUNDS objects per class; full and empty magazines are
+// traded with the per-class depot of the CPU's arena.
+#define KHEAP_MAG_MIN_SHIFT 4
+#define KHEAP_MAG_CLASS_COUNT 6
+#define KHEAP_MAG_MAX_SIZE (1 << (KHEAP_MAG_MIN_SHIFT + KHEAP_MAG_CLASS_COUNT - 1))
+#define KHEAP_MAG_ROUNDS 15
+// Full magazines the depot keeps per class; beyond that, objects go back to the heap.
+#define KHEAP_DEPOT_MAX_FULL 4
+
+// Frees above the magazine classes are coalesced lazily. A freed block for a
+// request of up to KHEAP_QUICK_MAX_SIZE bytes is not merged with its
+// neighbours but pushed, still allocated, on the arena's quick bin for its
+// exact size, and the next request of that size pops it again. An arena's
+// bins are flushed into the free lists, merging as free() would, once they
+// hold more than KHEAP_QUICK_MAX_BYTES or when an allocation finds no hole.
+#define KHEAP_QUICK_MAX_SIZE 0x1000
+#define KHEAP_QUICK_BIN_COUNT ((KHEAP_QUICK_MAX_SIZE - KHEAP_MAG_MAX_SIZE) / KHEAP_ALIGN)
+#define KHEAP_QUICK_MAX_BYTES 0x10000
+
+// kmalloc_atomic takes no heap lock: it is served from the CPU's magazines,
+// then from a per-CPU emergency reserve of KHEAP_RESERVE_ROUNDS objects per
+// class. Reserves are topped up in process context, by kheap_refill_reserves
+// or by the next kmalloc/kfree once they drop to KHEAP_RESERVE_LOW. Only the
+// profile and trace hooks lock: built with KHEAP_PROFILE or KHEAP_TRACE,
+// kmalloc_atomic and kfree_atomic take their irq_spin_lock, which is safe in
+// interrupts but spins while another CPU holds it.
+#define KHEAP_RESERVE_ROUNDS 8
+#define KHEAP_RESERVE_LOW (KHEAP_RESERVE_ROUNDS / 2)
+
+// Requests above KHEAP_LARGE_THRESHOLD bytes bypass the heap and are served
+// whole pages from vmalloc, so they never split or pin large holes. Their page
+// counts are kept in an open-addressed table of KHEAP_LARGE_TABLE_SIZE slots;
+// when it is three quarters full, large requests fall back to the heap.
+#define KHEAP_LARGE_THRESHOLD 0x4000
+#define KHEAP_LARGE_TABLE_SIZE 256
+
+// Number of footprint samples kept (one per expand or contract).
+#define KHEAP_FOOTPRINT_HISTORY 8
+
+// Holes are kept in TLSF-style segregated free lists. The first level splits
+// sizes by power of two, the second level splits each power-of-two range into
+// KHEAP_SL_INDEX_COUNT linear classes. Sizes below KHEAP_SMALL_BLOCK_SIZE all
+// go into first level 0, split linearly.
+#define KHEAP_SL_INDEX_COUNT_LOG2 4
+#define KHEAP_SL_INDEX_COUNT (1 << KHEAP_SL_INDEX_COUNT_LOG2)
+#define KHEAP_FL_INDEX_SHIFT 7
+#define KHEAP_SMALL_BLOCK_SIZE (1 << KHEAP_FL_INDEX_SHIFT)
+// floor(log2) of the largest possible hole (KHEAP_MAX - KHEAP_START < 2^29).
+#define KHEAP_FL_INDEX_MAX 28
+#define KHEAP_FL_INDEX_COUNT (KHEAP_FL_INDEX_MAX - KHEAP_FL_INDEX_SHIFT + 2)
+
+// 4 bytes, right in front of the payload. size is the size of the whole
+// block, header included; it is a multiple of KHEAP_ALIGN, so its low bits
+// hold the KHEAP_BLOCK_* flags. The heap ends with an epilogue header of size
+// 0 that is always in use, so every block has a header after it.
 struct kheap_block_header
 {
-    uint32_t magic;
-    uint8_t is_hole;
     uint32_t size;
-} __attribute__((packed));
+};
 typedef struct kheap_block_header kheap_block_header_t;
 
-// 8 bytes
+#define KHEAP_BLOCK_IN_USE (1 << 0)
+// The block on the left is in use. Only when it is clear may the word in
+// front of the header be read: it is the footer of a hole.
+#define KHEAP_BLOCK_PREV_IN_USE (1 << 1)
+#define KHEAP_BLOCK_FLAGS (KHEAP_ALIGN - 1)
+
+// 4 bytes, at the end of holes only; allocated blocks have no footer.
 struct kheap_block_footer
 {
-    uint32_t magic;
-    kheap_block_header_t *header;
-} __attribute__((packed));
+    uint32_t size; // same as the size of the hole, without flags
+};
 typedef struct kheap_block_footer kheap_block_footer_t;
 
+// Free list links, stored in the payload of a hole. The lists are doubly
+// linked so a hole can be unlinked without walking its list.
+struct kheap_free_links
+{
+    kheap_block_header_t *next;
+    kheap_block_header_t *prev;
+};
+typedef struct kheap_free_links kheap_free_links_t;
+
+typedef struct kheap_footprint_sample
+{
+    uint32_t tick;
+    uint32_t size;
+} kheap_footprint_sample_t;
+
+typedef struct kheap_footprint
+{
+    uint32_t peak_size;
+    uint32_t expands;
+    uint32_t contracts;
+    uint32_t released_pages; // frames given back to the PMM by contraction
+    uint32_t eager_pages;    // frames mapped eagerly by expansion
+    uint32_t expand_tick;    // getTick() of the last expansion
+    uint32_t history_num;
+    kheap_footprint_sample_t history[KHEAP_FOOTPRINT_HISTORY]; // ring, newest at history_num - 1
+} kheap_footprint_t;
+
+// A snapshot of heap health over all arenas, see kheap_get_stats().
+typedef struct kheap_stats
+{
+    uint32_t heap_size;     // bytes the arenas span, mapped or not
+    uint32_t in_use;        // bytes in allocated blocks, block metadata included
+    uint32_t hole_bytes;    // payload bytes in holes, the tail holes not counted
+    uint32_t hole_count;    // the tail holes not counted
+    uint32_t largest_hole;  // payload bytes of the largest hole that is not a tail hole
+    uint32_t frag_permille; // 1000 * (1 - largest hole / hole bytes)
+    uint32_t tail_bytes;    // payload bytes of the holes at the arena ends, which the arenas trim
+    uint32_t expands;
+    uint32_t contracts;
+    uint32_t headroom;      // bytes the fullest arena can still grow by
+    uint32_t quick_bytes;   // bytes of blocks waiting in quick bins, metadata included
+    uint32_t zero_skipped;  // bytes kzalloc did not clear because they were known zero
+    uint32_t large_count;   // allocations served from vmalloc
+    uint32_t large_pages;
+} kheap_stats_t;
+
+typedef struct kheap_magazine
+{
+    struct kheap_magazine *next; // depot list link
+    uint32_t rounds;
+    void *objs[KHEAP_MAG_ROUNDS];
+} kheap_magazine_t;
+
+typedef struct kheap_depot
+{
+    yieldlock_t lock;
+    kheap_magazine_t *full;
+    uint32_t full_num;
+    kheap_magazine_t *empty;
+} kheap_depot_t;
+
+typedef struct kheap_cpu_cache
+{
+    kheap_magazine_t *loaded[KHEAP_MAG_CLASS_COUNT];
+    kheap_magazine_t *previous[KHEAP_MAG_CLASS_COUNT];
+    uint32_t arena;  // arena this CPU allocates from
+    uint32_t hits;   // served from the CPU's own magazines
+    uint32_t trades; // went to the depot
+    uint32_t misses; // fell through to the heap
+
+    void *reserve[KHEAP_MAG_CLASS_COUNT][KHEAP_RESERVE_ROUNDS];
+    uint32_t reserve_num[KHEAP_MAG_CLASS_COUNT];
+    void *deferred;          // objects passed to kfree_atomic, linked through their payload
+    uint32_t refill_pending; // reserves are low or frees are deferred
+    uint32_t atomic_allocs;  // kmalloc_atomic calls served
+    uint32_t reserve_allocs; // ... of which from the reserve
+    uint32_t exhausted;      // kmalloc_atomic calls that failed
+    uint32_t deferred_frees;
+} __attribute__((aligned(64))) kheap_cpu_cache_t;
+
 typedef struct kernel_heap
 {
-    ordered_array_t index;
+    // Protects the blocks and free lists of the heap.
+    yieldlock_t lock;
+    // Serializes changes of end_address (expansion and contraction).
+    yieldlock_t expand_lock;
+    // Frame batch of an eager growth, under expand_lock.
+    uint32_t populate_frames[KHEAP_EAGER_MAX_PAGES];
+    kheap_depot_t depots[KHEAP_MAG_CLASS_COUNT];
+
+    // Bit fl is set in fl_bitmap if any list in free_lists[fl] is non-empty,
+    // bit sl is set in sl_bitmap[fl] if free_lists[fl][sl] is non-empty.
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[KHEAP_FL_INDEX_COUNT];
+    kheap_block_header_t *free_lists[KHEAP_FL_INDEX_COUNT][KHEAP_SL_INDEX_COUNT];
+    uint32_t hole_count;
+    uint32_t hole_bytes; // payload bytes of all holes
+
+    // Deferred frees by payload size, linked through the payload.
+    kheap_block_header_t *quick_bins[KHEAP_QUICK_BIN_COUNT];
+    uint32_t quick_count;
+    uint32_t quick_bytes; // metadata included
+    uint32_t quick_hits;
+    uint32_t quick_flushes;
+
+    // [zero_start, end of the last hole) has never been written since it was
+    // mapped, so kzalloc need not clear it. Every allocated block lies below.
+    uint32_t zero_start;
+    uint32_t zero_skipped; // bytes kzalloc left alone because they were known zero
+
     uint32_t start_address;
     uint32_t end_address;
     uint32_t size;
     uint32_t max_address;
     uint8_t supervisor;
     uint8_t readonly;
+    kheap_footprint_t footprint;
 } kheap_t;
 
 // ****************************************************************************
@@ -46,13 +237,90 @@ kheap_t create_kheap(uint32_t start, uint32_t end, uint32_t max, uint8_t supervi
 
 void *kmalloc(uint32_t size);
 
+// Page-aligned allocation, same as kmalloc_align(size, PAGE_SIZE).
 void *kmalloc_aligned(uint32_t size);
 
+// Allocation aligned to align bytes, which must be a power of two.
+void *kmalloc_align(uint32_t size, uint32_t align);
+
+// Zeroed allocation. Only the bytes the heap cannot prove to be zero, i.e.
+// those that were handed out before, are cleared: a block carved from freshly
+// grown heap pages costs no more than kmalloc.
+void *kzalloc(uint32_t size);
+
+// Zeroed array of num elements of size bytes. Returns NULL if the total size
+// overflows.
+void *kcalloc(uint32_t num, uint32_t size);
+
+// Allocate from a given arena instead of the current CPU's one, so that an
+// allocation-heavy subsystem can keep its blocks apart from everyone else's.
+// Always served from the arena itself, whatever the size, and NULL once it
+// is full. The other allocation functions move on to the next arena instead.
+void *kmalloc_arena(uint32_t arena, uint32_t size);
+
+// Allocation for interrupt context: takes no heap lock and never waits (see
+// KHEAP_RESERVE_ROUNDS for the profile and trace hooks). Only sizes up
+// to KHEAP_MAG_MAX_SIZE are supported; returns NULL when the CPU's magazines
+// and reserve for the class are both empty.
+void *kmalloc_atomic(uint32_t size);
+
+// Free for interrupt context. The object goes into the CPU's magazines, or is
+// queued and freed by the next refill if they are full.
+void kfree_atomic(void *p);
+
+// Top up the current CPU's reserves and run its deferred frees. Must not be
+// called from interrupt context.
+void kheap_refill_reserves();
+
+// Bind a CPU to an arena. Objects cached in its magazines are given back
+// first, so a CPU can only rebind itself: cpu must be the current CPU.
+void kheap_bind_cpu(uint32_t cpu, uint32_t arena);
+
+uint32_t kheap_arena_of(void *ptr);
+
+// Resize an allocation. Grows or shrinks in place when the block on the
+// right allows it, otherwise moves the data to a new block. Returns NULL and
+// leaves p allocated if there is no memory for the new block.
+void *krealloc(void *p, uint32_t new_size);
+
 void kfree(void *p);
 
 uint32_t kheap_validate_print(uint8_t print);
 
+void kheap_get_footprint(uint32_t arena, kheap_footprint_t *footprint);
+
+void kheap_footprint_dump();
+
+// Fill in a snapshot from counters kept up to date by every heap operation.
+// Each arena is read under its lock in constant time (plus the walk of its
+// highest free list for the largest hole), so this is cheap enough to poll.
+void kheap_get_stats(kheap_stats_t *stats);
+
+void kheap_stats_dump();
+
+// Give the objects cached in the current CPU's magazines, the depots and the
+// quick bins back to the heap. Other CPUs' magazines belong to them alone, so
+// each CPU drains its own.
+void kheap_drain_magazines();
+
+// Contract arenas whose tail hole is large and that have not grown for
+// idle_ticks ticks. The idle loop passes KHEAP_CONTRACT_DELAY.
+void kheap_reclaim(uint32_t idle_ticks);
+
+void kheap_magazine_dump();
+
+void kheap_lock_dump();
+
 // ******************************** unit tests **********************************
 void kheap_test();
 void kheap_killer();
+void kheap_realloc_test();
+void kheap_quick_test();
+void kheap_align_test();
+void kheap_contract_test();
+void kheap_zero_test();
+void kheap_arena_test();
+void kheap_large_test();
+void kheap_atomic_test();
+void kheap_stats_test();
 #endif
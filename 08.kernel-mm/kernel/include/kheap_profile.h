@@ -0,0 +1,60 @@
+#ifndef KHEAP_PROFILE_H
+#define KHEAP_PROFILE_H
+
+#include "types.h"
+
+// Allocation profiler for the kernel heap, built in with -DKHEAP_PROFILE.
+// Every live allocation made through the public kmalloc family has an entry
+// in a side table with the caller's return address, the requested size and
+// the tick it was made at. kheap_profile_dump() reports the top call sites by
+// bytes and by count, size histograms and the oldest live allocations as leak
+// candidates. Without the flag all hooks are empty and compile away.
+
+// Live allocations tracked; allocations beyond that are counted as dropped.
+#define KHEAP_PROFILE_SLOTS 4096
+// Slots of the call site table built by a report, which holds up to three
+// quarters as many distinct sites.
+#define KHEAP_PROFILE_SITES 256
+// Entries in each top-N list of a report.
+#define KHEAP_PROFILE_TOP 8
+// Size histogram buckets: bucket b counts sizes in [2^b, 2^(b+1)).
+#define KHEAP_PROFILE_BUCKETS 32
+
+#define KHEAP_CALLER ((uint32_t)__builtin_return_address(0))
+
+typedef struct kheap_profile_entry
+{
+    uint32_t ptr; // 0 marks a free slot
+    uint32_t caller;
+    uint32_t size;
+    uint32_t tick;
+} kheap_profile_entry_t;
+
+// ****************************************************************************
+#ifdef KHEAP_PROFILE
+void kheap_profile_alloc(void *ptr, uint32_t size, uint32_t caller);
+void kheap_profile_free(void *ptr);
+
+// Print the report. Live allocations at least leak_age ticks old are listed
+// as leak candidates, oldest first.
+void kheap_profile_dump(uint32_t leak_age);
+#else
+static inline void kheap_profile_alloc(void *ptr, uint32_t size, uint32_t caller)
+{
+    UNUSED(ptr);
+    UNUSED(size);
+    UNUSED(caller);
+}
+
+static inline void kheap_profile_free(void *ptr)
+{
+    UNUSED(ptr);
+}
+
+static inline void kheap_profile_dump(uint32_t leak_age)
+{
+    UNUSED(leak_age);
+}
+#endif // KHEAP_PROFILE
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef KHEAP_TRACE_H
+#define KHEAP_TRACE_H
+
+#include "types.h"
+
+// Allocation traces and a replay benchmark for the kernel heap.
+//
+// A trace is a sequence of malloc/free/realloc operations on numbered
+// objects: pointers are replaced by the index of the allocation that created
+// the object, so a trace can be replayed against any heap. Traces are either
+// generated (kheap_trace_synthetic) or recorded from the real kmalloc traffic
+// when built with -DKHEAP_TRACE. kheap_trace_replay() times every operation
+// with the TSC and reports throughput, latency percentiles, peak footprint
+// and fragmentation, so allocator changes can be compared on the same work.
+
+#define KHEAP_TRACE_MALLOC 0
+#define KHEAP_TRACE_FREE 1
+#define KHEAP_TRACE_REALLOC 2
+
+// Live objects a recording can map back to their ids.
+#define KHEAP_TRACE_SLOTS 4096
+// Latency histogram buckets: bucket b counts operations of [2^b, 2^(b+1)) cycles.
+#define KHEAP_TRACE_BUCKETS 32
+// The heap footprint is sampled every this many replayed operations.
+#define KHEAP_TRACE_SAMPLE_OPS 64
+
+// 8 bytes
+typedef struct kheap_trace_op
+{
+    uint32_t op : 2;
+    uint32_t id : 30; // object: index of the malloc that created it
+    uint32_t size;    // malloc and realloc only
+} kheap_trace_op_t;
+
+typedef struct kheap_trace
+{
+    kheap_trace_op_t *ops;
+    uint32_t capacity;
+    uint32_t op_num;
+    uint32_t id_num;   // objects created by the trace
+    uint32_t overflow; // operations lost because the buffer or the live table was full
+} kheap_trace_t;
+
+typedef struct kheap_bench_result
+{
+    uint32_t ops;
+    uint32_t failed;        // allocations that returned NULL
+    uint32_t ops_per_sec;
+    uint32_t cycles_per_op; // mean
+    uint32_t p50_cycles;    // upper bound of the bucket holding the median
+    uint32_t p99_cycles;
+    uint32_t tsc_per_tick;
+    uint32_t peak_resident; // most bytes of frames taken since the replay started
+    uint32_t peak_frag_permille;
+    uint32_t hist[KHEAP_TRACE_BUCKETS];
+} kheap_bench_result_t;
+
+// ****************************************************************************
+// The operation buffer is taken from vmalloc, so it does not disturb the heap.
+bool_t kheap_trace_create(kheap_trace_t *trace, uint32_t capacity);
+void kheap_trace_destroy(kheap_trace_t *trace);
+
+// Fill the trace with a random mix of mostly small allocations, frees and
+// reallocs. The same seed always gives the same trace.
+void kheap_trace_synthetic(kheap_trace_t *trace, uint32_t seed);
+
+// Replay a trace and measure it. Objects still live at the end are freed
+// afterwards. Needs the timer interrupt to calibrate the TSC.
+bool_t kheap_trace_replay(const kheap_trace_t *trace, kheap_bench_result_t *result);
+
+void kheap_bench_print(const kheap_bench_result_t *result);
+
+// Replay a synthetic trace and print the result.
+void kheap_bench();
+
+#ifdef KHEAP_TRACE
+// Record every kmalloc family operation into trace until it is full or
+// recording is stopped.
+void kheap_trace_record_start(kheap_trace_t *trace);
+void kheap_trace_record_stop();
+
+void kheap_trace_on_alloc(void *ptr, uint32_t size);
+void kheap_trace_on_free(void *ptr);
+void kheap_trace_on_realloc(void *old_ptr, void *new_ptr, uint32_t size);
+#else
+static inline void kheap_trace_on_alloc(void *ptr, uint32_t size)
+{
+    UNUSED(ptr);
+    UNUSED(size);
+}
+
+static inline void kheap_trace_on_free(void *ptr)
+{
+    UNUSED(ptr);
+}
+
+static inline void kheap_trace_on_realloc(void *old_ptr, void *new_ptr, uint32_t size)
+{
+    UNUSED(old_ptr);
+    UNUSED(new_ptr);
+    UNUSED(size);
+}
+#endif // KHEAP_TRACE
+
+#endif
@@ -0,0 +1,57 @@
+/**
+ * @file kmap.h
+ * @brief 临时映射 (kmap_atomic) 接口
+ *
+ * 内核直接映射区只覆盖低端物理内存，访问任意物理页（清零、复制、构建页表）
+ * 需要一个临时的虚拟地址。本模块在 FIXMAP 窗口中为每个 CPU 预留少量页表项，
+ * 映射与解除映射都只修改一个 PTE，整个生命周期只需要一次 invlpg，
+ * 不会占用或污染全局内核虚拟地址空间。
+ */
+
+#ifndef KMAP_H
+#define KMAP_H
+
+#include "types.h"
+#include "cpu.h"
+
+#define FIXMAP_START 0xE0400000 /**< 临时映射窗口起始地址（独占一个页表） */
+#define FIXMAP_END 0xE0800000   /**< 临时映射窗口结束地址 */
+
+/**
+ * @brief 每个 CPU 的临时映射槽数，即允许的最大嵌套深度
+ * @note 槽按栈方式使用：中断处理程序嵌套在普通路径之上，天然满足后进先出。
+ */
+#define KMAP_SLOTS_PER_CPU 8
+
+/**
+ * @brief 初始化临时映射窗口
+ */
+void kmap_init(void);
+
+/**
+ * @brief 将一个物理页临时映射到当前 CPU 的下一个空闲槽
+ *
+ * @param paddr 物理页地址（必须按页对齐）
+ * @return void* 可访问该物理页的虚拟地址
+ * @note 必须以相反的顺序调用 kunmap_atomic() 释放；期间不能让出 CPU。
+ */
+void *kmap_atomic(uint32_t paddr);
+
+/**
+ * @brief 解除 kmap_atomic() 建立的映射
+ *
+ * @param vaddr kmap_atomic() 的返回值，必须是当前 CPU 最近一次映射的槽
+ */
+void kunmap_atomic(void *vaddr);
+
+/**
+ * @brief 将一个物理页清零（无需该页已映射）
+ */
+void kmap_zero_frame(uint32_t paddr);
+
+/**
+ * @brief 复制一个物理页的内容（无需两页已映射）
+ */
+void kmap_copy_frame(uint32_t dst_paddr, uint32_t src_paddr);
+
+#endif // KMAP_H
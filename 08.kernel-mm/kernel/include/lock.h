@@ -25,4 +25,21 @@ void cpu_cli(void);
 void cpu_sti(void);
 uint32_t cpu_save_flags_and_cli(void);
 
+/* 关中断后自旋获取 *lock，返回原 eflags。
+ * 用于中断上下文也会进入的短临界区：持锁期间本 CPU 不会被中断重入 */
+static inline uint32_t irq_spin_lock(volatile uint32_t *lock)
+{
+    uint32_t eflags = cpu_save_flags_and_cli();
+    while (atomic_exchange(lock, 1) != 0)
+    {
+    }
+    return eflags;
+}
+
+static inline void irq_spin_unlock(volatile uint32_t *lock, uint32_t eflags)
+{
+    atomic_exchange(lock, 0);
+    set_eflags(eflags);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,85 @@
+/**
+ * @file page_idle.h
+ * @brief 空闲页跟踪 / 工作集估算 接口
+ *
+ * 跟踪器在时钟中断中以固定预算增量扫描带有 VMM_REGION_TRACK_IDLE 标志的区域，
+ * 采样并清除页表项的访问位 (Accessed)。每个页的“空闲代数”保存在页表项的
+ * 3 个软件可用位中，不需要任何额外内存。每完成一轮扫描，就为每个区域
+ * 发布一次热/温/冷页统计，并记录工作集大小的历史。
+ */
+
+#ifndef PAGE_IDLE_H
+#define PAGE_IDLE_H
+
+#include "types.h"
+#include "vmm.h"
+
+/**
+ * @brief 每个时钟节拍最多检查的页表项数（一个页表）
+ */
+#define PAGE_IDLE_SCAN_BATCH 1024
+
+/**
+ * @brief 空闲代数保存在 PTE 的 avail 位 (bit 9..11)
+ */
+#define PAGE_IDLE_AGE_SHIFT 9
+#define PAGE_IDLE_AGE_MASK (0x7 << PAGE_IDLE_AGE_SHIFT)
+#define PAGE_IDLE_AGE_MAX 7
+
+/**
+ * @brief 分类阈值：age == 0 为热页，age <= WARM 为温页，其余为冷页
+ * @note age 表示连续多少轮扫描未被访问。
+ */
+#define PAGE_IDLE_WARM_AGE 2
+
+/**
+ * @brief 每个区域保留的工作集历史样本数
+ */
+#define PAGE_IDLE_HISTORY 8
+
+typedef struct page_idle_sample
+{
+    uint32_t tick;     /**< 该轮扫描完成时的时钟节拍 */
+    uint32_t ws_pages; /**< 工作集（热页 + 温页）页数 */
+} page_idle_sample_t;
+
+/**
+ * @brief 一个区域最近一轮扫描的结果
+ */
+typedef struct page_idle_stats
+{
+    uint32_t resident; /**< 映射了真实物理页的页数（不含共享零页） */
+    uint32_t hot;
+    uint32_t warm;
+    uint32_t cold;
+    uint32_t passes; /**< 已完成的扫描轮数 */
+    uint32_t history_num;
+    page_idle_sample_t history[PAGE_IDLE_HISTORY]; /**< 环形缓冲，最新样本在 history_num - 1 处 */
+} page_idle_stats_t;
+
+/**
+ * @brief 初始化空闲页跟踪器，并挂到时钟中断上
+ */
+void page_idle_init(void);
+
+/**
+ * @brief 扫描最多 budget 个页表项，推进扫描游标
+ * @note 由时钟钩子调用；也可在需要立即刷新统计时手动调用。
+ */
+void page_idle_scan(uint32_t budget);
+
+/**
+ * @brief 读取一个区域最近一轮扫描的统计快照
+ *
+ * @param region_index 区域下标（同 vmm_region_get）
+ * @param stats 输出
+ * @return true 成功；false 区域不存在或未被跟踪
+ */
+bool_t page_idle_get_stats(uint32_t region_index, page_idle_stats_t *stats);
+
+/**
+ * @brief 打印所有被跟踪区域的工作集统计
+ */
+void page_idle_dump(void);
+
+#endif // PAGE_IDLE_H
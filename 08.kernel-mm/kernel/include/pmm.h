@@ -95,6 +95,18 @@ void pmm_init(boot_info_t *boot_info);
  */
 uint32_t pmm_alloc_page(void);
 
+/**
+ * @brief 一次分配多个（不要求连续的）物理页
+ *
+ * 与循环调用 pmm_alloc_page 等价，但只做一趟位图扫描，并整字节跳过已满的位图。
+ * 要么全部分配成功，要么一页都不分配。
+ *
+ * @param frames 输出数组，至少 count 项
+ * @param count 页数
+ * @return true 成功；false 空闲页不足
+ */
+bool_t pmm_alloc_pages(uint32_t *frames, uint32_t count);
+
 /**
  * @brief 释放一个先前分配的物理页
  *
@@ -108,6 +120,26 @@ uint32_t pmm_alloc_page(void);
  */
 void pmm_free_page(uint32_t paddr);
 
+/**
+ * @brief 分配一段连续且按指定页数对齐的物理页
+ *
+ * 用于大页 (4MB) 等需要物理连续内存的场景。与 pmm_alloc_page 不同，
+ * 此函数按对齐边界做首次适配扫描，代价与物理内存大小成正比。
+ *
+ * @param count 页数
+ * @param align_pages 对齐（页数，必须是 2 的幂）
+ * @return 成功时返回起始物理地址；找不到满足条件的连续区域时返回 0。
+ */
+uint32_t pmm_alloc_contiguous(uint32_t count, uint32_t align_pages);
+
+/**
+ * @brief 释放一段由 pmm_alloc_contiguous 分配的连续物理页
+ *
+ * @param paddr 起始物理地址
+ * @param count 页数
+ */
+void pmm_free_contiguous(uint32_t paddr, uint32_t count);
+
 /**
  * @brief 获取当前空闲物理页的数量
  *
@@ -0,0 +1,42 @@
+#ifndef PTR_TABLE_H
+#define PTR_TABLE_H
+
+#include "types.h"
+
+// An open-addressed hash table keyed by address, for the side tables kept on
+// live allocations. Entries are the caller's structs, whose first field is
+// the uint32_t key; a key of 0 marks a free slot. The slot count is a power of
+// two. A quarter of the slots is kept free so that probe sequences stay short,
+// and removal moves entries back instead of leaving tombstones.
+typedef struct ptr_table
+{
+    void *entries;
+    uint32_t entry_size;
+    uint32_t slots;
+    uint32_t shift; // low key bits that are always zero, dropped before hashing
+    uint32_t count;
+} ptr_table_t;
+
+// Initializer for a table over a static, zeroed entry array.
+#define PTR_TABLE_INIT(array, key_shift) \
+    {(array), sizeof((array)[0]), sizeof(array) / sizeof((array)[0]), (key_shift), 0}
+
+static inline bool_t ptr_table_full(ptr_table_t *this)
+{
+    return this->count >= this->slots / 4 * 3;
+}
+
+// Empty the table.
+void ptr_table_clear(ptr_table_t *this);
+
+// Take a slot for key, which must not be in the table yet, and set its key.
+// The caller fills in the rest of the entry. Returns NULL if the table is full.
+void *ptr_table_insert(ptr_table_t *this, uint32_t key);
+
+// Returns the entry of key, or NULL if it is not in the table.
+void *ptr_table_find(ptr_table_t *this, uint32_t key);
+
+// Remove an entry returned by ptr_table_find() or ptr_table_insert().
+void ptr_table_remove(ptr_table_t *this, void *entry);
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * @file slab.h
+ * @brief Slab 分配器 (kmem_cache) 接口
+ *
+ * 为固定大小的内核对象提供 O(1) 的分配与释放：
+ * - 每个 cache 管理若干 slab，每个 slab 是一段从 vmalloc 取得、按自身大小对齐的页；
+ * - slab 描述符放在 slab 的开头，空闲对象通过其中的一个字串成空闲链表，
+ *   由地址向下对齐即可找到所属 slab；
+ * - 不同 slab 的对象起始偏移错开一个对齐单位（着色），使热点对象分散到不同缓存组；
+ * - 构造函数只在 slab 创建时对每个对象调用一次，对象释放时须恢复到已构造状态，
+ *   再次分配时直接复用，不必重新初始化。
+ *
+ * 没有构造函数时链接指针借用空闲对象的第一个字，对象没有额外的元数据；
+ * 有构造函数时链接指针放在对象之后多占的一个字里，构造出的状态完整保留。
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include "types.h"
+#include "yieldlock.h"
+
+#define KMEM_CACHE_NAME_LEN 16
+
+/**
+ * @brief 默认对齐 / 着色单位（一条缓存行）
+ */
+#define SLAB_CACHE_LINE 64
+
+/**
+ * @brief 小对象的 slab 只占一页；大对象的 slab 至少容纳这么多对象
+ */
+#define SLAB_MIN_OBJS 8
+
+/**
+ * @brief 每个 cache 保留的空 slab 数，超出的空 slab 立即归还给 vmalloc
+ */
+#define SLAB_MAX_EMPTY 1
+
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct slab
+{
+    struct slab *prev;
+    struct slab *next;
+    struct kmem_cache *cache;
+    void *freelist;     /**< 空闲对象链表，链接指针在对象内偏移 free_offset 处 */
+    uint32_t inuse;     /**< 已分配的对象数 */
+    uint32_t color;     /**< 对象区相对描述符之后的偏移（字节） */
+} slab_t;
+
+typedef struct slab_list
+{
+    slab_t *head;
+    uint32_t count;
+} slab_list_t;
+
+typedef struct kmem_cache
+{
+    char name[KMEM_CACHE_NAME_LEN];
+    uint32_t obj_size;      /**< 按对齐向上取整后的对象大小 */
+    uint32_t align;
+    uint32_t free_offset;   /**< 链接指针在空闲对象中的偏移：无构造函数时为 0，否则紧跟对象 */
+    kmem_ctor_t ctor;
+    uint32_t slab_pages;    /**< 每个 slab 的页数（2 的幂） */
+    uint32_t objs_per_slab;
+    uint32_t color_max;     /**< 可用的着色偏移上限（slab 尾部的剩余字节） */
+    uint32_t color_next;    /**< 下一个新 slab 使用的着色偏移 */
+    slab_list_t partial;
+    slab_list_t full;
+    slab_list_t empty;
+    uint32_t active_objs;
+    uint32_t total_objs;
+    yieldlock_t lock;
+    struct kmem_cache *next; /**< 全局 cache 链表 */
+} kmem_cache_t;
+
+// ****************************************************************************
+void kmem_cache_init(void);
+
+/**
+ * @brief 创建一个对象 cache
+ *
+ * @param name 名称（最多 KMEM_CACHE_NAME_LEN - 1 个字符）
+ * @param size 对象大小（字节）
+ * @param align 对齐（2 的幂；0 表示按字长对齐）
+ * @param ctor 构造函数，可为 NULL
+ * @return kmem_cache_t* 新 cache；参数非法或内存耗尽时返回 NULL
+ */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor);
+
+/**
+ * @brief 销毁一个 cache，归还其全部 slab
+ * @note 调用前所有对象都必须已经释放。
+ */
+void kmem_cache_destroy(kmem_cache_t *cache);
+
+void *kmem_cache_alloc(kmem_cache_t *cache);
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/**
+ * @brief 打印所有 cache 的使用情况
+ */
+void kmem_cache_dump(void);
+
+// ******************************** unit tests **********************************
+void slab_test();
+
+#endif // SLAB_H
@@ -4,6 +4,7 @@
 #include "types.h"
 
 void *memset(void *dest, int val, size_t len);
+void *memzero(void *dest, size_t len);
 void *memcpy(void *dest, const void *src, size_t len);
 void *memmove(void *dest, const void *src, size_t len);
 size_t strlen(const char *str);
@@ -0,0 +1,76 @@
+/**
+ * @file thp.h
+ * @brief 透明大页 (Transparent Huge Pages) 接口
+ *
+ * 带有 VMM_REGION_THP 标志的匿名区域中，按 4MB 对齐且完全落在区域内的范围
+ * 可以用一个 PSE 大页映射，省去 1023 次缺页和 1024 个 TLB 条目：
+ * - 缺页时：仅对带 VMM_REGION_THP_FAULT 的区域（注册者声明区域会被整段用满），
+ *   若整个 4MB 范围尚无真实物理页，且 PMM 能给出对齐的连续 4MB，直接映射大页；
+ *   否则回退到 4KB 按需分页。一次写入无法说明整个 4MB 都会被用到，
+ *   其它区域因此不在缺页时提升，以免几个字节就占住 4MB 连续内存。
+ * - 后台折叠：khugepaged 定期扫描这些范围，把已被 4KB 页密集填充的页表
+ *   复制到一个连续大页中，并释放原来的零散物理页。
+ */
+
+#ifndef THP_H
+#define THP_H
+
+#include "types.h"
+#include "vmm.h"
+#include "timer.h"
+
+/**
+ * @brief 页表中至少有这么多真实物理页时才值得折叠为大页
+ * @note 其余页会被补零，因此阈值同时限制了折叠带来的额外内存占用。
+ */
+#define THP_COLLAPSE_MIN_PTES 512
+
+/**
+ * @brief khugepaged 两次运行之间的最小间隔（时钟节拍）
+ */
+#define THP_COLLAPSE_INTERVAL TIMER_FREQUENCY
+
+/**
+ * @brief khugepaged 每次运行最多检查的 4MB 范围数
+ */
+#define THP_COLLAPSE_SCAN_RANGES 8
+
+typedef struct thp_stats
+{
+    uint32_t fault_promotions; /**< 缺页时直接映射的大页数 */
+    uint32_t fault_fallbacks;  /**< 范围符合条件但没有连续物理内存，回退到 4KB */
+    uint32_t collapses;        /**< khugepaged 折叠成功的页表数 */
+    uint32_t collapse_fallbacks; /**< 页表足够密集但没有连续物理内存 */
+    uint32_t splits;           /**< 被拆分回 4KB 的大页数 */
+} thp_stats_t;
+
+extern thp_stats_t thp_stats;
+
+/**
+ * @brief 尝试以大页处理一次匿名区域内的写缺页
+ *
+ * @param region 故障地址所在区域（须带 VMM_REGION_THP_FAULT）
+ * @param faulting_addr 故障地址
+ * @return true 已映射大页，缺页处理完成
+ * @return false 不符合条件或回退，调用者应按 4KB 处理
+ */
+bool_t thp_handle_fault(vmm_region_t *region, uint32_t faulting_addr);
+
+/**
+ * @brief 扫描最多 max_ranges 个 4MB 范围，折叠其中第一个足够密集的页表
+ *
+ * @return uint32_t 折叠成功的页表数（0 或 1）
+ */
+uint32_t thp_collapse_scan(uint32_t max_ranges);
+
+/**
+ * @brief 后台折叠入口，在内核空闲循环中调用，按 THP_COLLAPSE_INTERVAL 限速
+ */
+void thp_khugepaged(void);
+
+/**
+ * @brief 打印透明大页统计
+ */
+void thp_dump(void);
+
+#endif // THP_H
@@ -4,9 +4,17 @@
 #include "types.h"
 
 #define TIMER_FREQUENCY 50
+#define TIMER_MAX_HOOKS 4
+
+// Hooks run on every tick in interrupt context, so they must be short and
+// must not take a yieldlock.
+typedef void (*timer_hook_t)(uint32_t tick);
 
 void init_timer(uint32_t frequency);
 
 uint32_t getTick();
 
+// Return 1 for success, or 0 if the hook table is full.
+uint32_t timer_add_hook(timer_hook_t hook);
+
 #endif
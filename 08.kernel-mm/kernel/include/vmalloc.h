@@ -0,0 +1,55 @@
+/**
+ * @file vmalloc.h
+ * @brief 页粒度内核虚拟内存分配器 接口
+ *
+ * 在 [VMALLOC_START, VMALLOC_END) 窗口中分配虚拟连续、按页对齐的内存，
+ * 分配时立即从 PMM 取物理页并建立映射，释放时解除映射并归还物理页。
+ * 它不经过 kheap 的空洞索引，适合作为 slab 等上层分配器的页来源。
+ */
+
+#ifndef VMALLOC_H
+#define VMALLOC_H
+
+#include "types.h"
+
+#define VMALLOC_START 0xE0800000 /**< 窗口起始地址 */
+#define VMALLOC_END 0xEF000000   /**< 窗口结束地址，其上为内核栈的增长空间 */
+#define VMALLOC_PAGES ((VMALLOC_END - VMALLOC_START) / 4096)
+
+/**
+ * @brief 初始化 vmalloc 窗口
+ */
+void vmalloc_init(void);
+
+/**
+ * @brief 分配 pages 个连续虚拟页，起始地址按 align_pages 页对齐
+ *
+ * @param pages 页数
+ * @param align_pages 对齐（页数，必须是 2 的幂，1 表示只按页对齐）
+ * @return void* 起始虚拟地址；虚拟地址或物理内存耗尽时返回 NULL
+ * @note 返回的内存内容未定义。
+ */
+void *vmalloc_pages(uint32_t pages, uint32_t align_pages);
+
+/**
+ * @brief 释放 vmalloc_pages() 分配的内存
+ *
+ * @param addr 起始虚拟地址
+ * @param pages 分配时的页数
+ */
+void vfree_pages(void *addr, uint32_t pages);
+
+/**
+ * @brief 地址是否位于 vmalloc 窗口内
+ */
+static inline bool_t is_vmalloc_addr(const void *addr)
+{
+    return (uint32_t)addr >= VMALLOC_START && (uint32_t)addr < VMALLOC_END;
+}
+
+/**
+ * @brief 当前已分配的页数
+ */
+uint32_t vmalloc_used_pages(void);
+
+#endif // VMALLOC_H
@@ -26,8 +26,63 @@
 #define PAGE_CACHE_DISABLE (1 << 4)
 #define PAGE_ACCESSED (1 << 5)
 #define PAGE_DIRTY (1 << 6)
+#define PAGE_PAT (1 << 7)
+#define PAGE_LARGE (1 << 7) /**< 页目录项中的 PS 位: 该项直接映射一个 4MB 大页 */
 
 #define PAGE_KERNEL_FLAGS (PAGE_PRESENT | PAGE_RW)
+#define PAGE_KERNEL_RO_FLAGS (PAGE_PRESENT)
+
+// Page Fault 错误码位 (由 CPU 压栈)
+#define PF_PRESENT (1 << 0) /**< 1: 保护违例; 0: 页不存在 */
+#define PF_WRITE (1 << 1)   /**< 1: 写访问; 0: 读访问 */
+#define PF_USER (1 << 2)    /**< 1: 用户态访问; 0: 内核态访问 */
+
+// 大页 (PSE)
+#define LARGE_PAGE_SIZE 0x400000
+#define LARGE_PAGE_PAGES (LARGE_PAGE_SIZE / PAGE_SIZE)
+#define LARGE_PAGE_ALIGN_DOWN(addr) ((addr) & ~(LARGE_PAGE_SIZE - 1))
+
+// CR0 控制位
+#define CR0_WP (1 << 16) /**< 写保护: 内核态写只读页同样触发 Page Fault */
+
+// CR4 控制位
+#define CR4_PSE (1 << 4) /**< 允许页目录项映射 4MB 大页 */
+
+// ====================================================================
+// 缓存类型 (PAT)
+// ====================================================================
+
+/**
+ * PAT 表项索引 = PAT << 2 | PCD << 1 | PWT。vmm_init 将 IA32_PAT 编程为：
+ *   PA0 = WB, PA1 = WT, PA2 = UC-, PA3 = UC  (与上电默认值一致)
+ *   PA4 = WC, PA5 = WT, PA6 = UC-, PA7 = UC
+ * 因此旧的 PWT/PCD 组合语义保持不变，只有 PAT 位选中写合并。
+ */
+#define MSR_IA32_PAT 0x277
+#define PAT_TYPE_UC 0x00
+#define PAT_TYPE_WC 0x01
+#define PAT_TYPE_WT 0x04
+#define PAT_TYPE_WB 0x06
+#define PAT_TYPE_UC_MINUS 0x07
+#define PAT_ENTRY(index, type) ((uint64_t)(type) << ((index) * 8))
+
+// vmm_map_page() 的缓存类型标志组合
+#define PAGE_CACHE_WB 0
+#define PAGE_CACHE_WT (PAGE_WRITETHROUGH)
+#define PAGE_CACHE_UC (PAGE_CACHE_DISABLE | PAGE_WRITETHROUGH)
+#define PAGE_CACHE_WC (PAGE_PAT)
+#define PAGE_CACHE_MASK (PAGE_WRITETHROUGH | PAGE_CACHE_DISABLE | PAGE_PAT)
+
+/**
+ * @brief 内存缓存类型
+ */
+typedef enum vmm_cache_type
+{
+  VMM_CACHE_WB = 0, /**< Write-Back: 普通内存 */
+  VMM_CACHE_WT,     /**< Write-Through */
+  VMM_CACHE_UC,     /**< Uncached: 设备寄存器 */
+  VMM_CACHE_WC,     /**< Write-Combining: 帧缓冲等流式写入 */
+} vmm_cache_type_t;
 
 // 地址对齐宏
 #define PAGE_SIZE 4096
@@ -46,6 +101,8 @@
 #define PAGE_DIR_VIRTUAL 0xC0701000         /**< 页目录的虚拟地址 */
 #define PAGE_TABLES_VIRTUAL_ADDR 0xC0400000 /**< 页表区域的起始虚拟地址 */
 #define KERNEL_LOAD_VIRTUAL_ADDR 0xC0800000 /**< 内核加载的虚拟地址 */
+#define IOREMAP_START 0xE0000000            /**< 设备内存映射窗口起始地址 */
+#define IOREMAP_END 0xE0400000              /**< 设备内存映射窗口结束地址 (4MB) */
 
 // ********************* physical memory layout *********************************
 #define KERNEL_PAGE_DIR_PHY 0x00101000       /**< 页目录的物理地址 */
@@ -71,6 +128,16 @@ typedef struct page_table_entry
 
 typedef page_table_entry_t page_directory_entry_t;
 
+/**
+ * @brief 页目录项是否映射了一个 4MB 大页
+ * @note 页目录项复用页表项结构，PS 位 (PAGE_LARGE) 按原始位读取。
+ */
+static inline bool_t pde_is_large(page_directory_entry_t *pde)
+{
+  uint32_t raw = *(uint32_t *)pde;
+  return (raw & (PAGE_PRESENT | PAGE_LARGE)) == (PAGE_PRESENT | PAGE_LARGE);
+}
+
 typedef struct page_directory
 {
   page_directory_entry_t entries[1024];
@@ -81,6 +148,29 @@ typedef struct page_table
   page_table_entry_t entries[1024];
 } __attribute__((aligned(PAGE_SIZE))) page_table_t;
 
+// ====================================================================
+// 虚拟内存区域
+// ====================================================================
+
+#define VMM_MAX_REGIONS 8
+
+// 区域标志位
+#define VMM_REGION_ANON (1 << 0)       /**< 匿名内存: 按需分配、零填充，读缺页映射共享零页 */
+#define VMM_REGION_TRACK_IDLE (1 << 1) /**< 由空闲页跟踪器采样访问位，统计工作集 */
+#define VMM_REGION_THP (1 << 2)        /**< 匿名区域内按 4MB 对齐的范围可由 khugepaged 折叠为透明大页 */
+#define VMM_REGION_THP_FAULT (1 << 3)  /**< 区域会被整段用满: 首次写缺页即直接映射大页（须同时带 VMM_REGION_THP） */
+
+/**
+ * @brief 一段由 VMM 管理缺页行为的内核虚拟地址区间 [start, end)
+ */
+typedef struct vmm_region
+{
+  const char *name;
+  uint32_t start;
+  uint32_t end;
+  uint32_t flags;
+} vmm_region_t;
+
 // ====================================================================
 // VMM 核心接口
 // ====================================================================
@@ -99,12 +189,61 @@ void vmm_init(void);
  *
  * @param virt_addr 要映射的虚拟地址（必须按页对齐）
  * @param phys_addr 要映射的物理地址（必须按页对齐）
- * @param flags 页的权限标志 (如 PAGE_KERNEL_FLAGS)
+ * @param flags 页的权限标志 (如 PAGE_KERNEL_FLAGS)，可按位或上 PAGE_CACHE_* 选择缓存类型
  * @return true 映射成功
  * @return false 映射失败 (例如，页表未正确设置)
  */
 bool_t vmm_map_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
 
+/**
+ * @brief 把一段连续虚拟地址批量映射到给定的物理页
+ *
+ * 逐页写页表项，最后只刷新一次 TLB：如果所有被改写的页表项原来都不存在，
+ * 则完全不需要刷新（x86 不缓存不存在的映射）；否则整体刷新一次。
+ *
+ * @param virt_addr 起始虚拟地址（必须按页对齐）
+ * @param frames 每页对应的物理地址；为 0 的项跳过，保持原映射不变
+ * @param count 页数
+ * @param flags 页的权限标志，同 vmm_map_page
+ * @return true 映射成功
+ * @return false 某个页表不存在，此前的页已经映射
+ */
+bool_t vmm_map_range(uint32_t virt_addr, const uint32_t *frames, uint32_t count, uint32_t flags);
+
+/**
+ * @brief 获取一个虚拟地址在当前地址空间中的页表项
+ *
+ * @param virt_addr 虚拟地址
+ * @return page_table_entry_t* 页表项指针；对应页表不存在或该地址位于大页内时返回 NULL
+ */
+page_table_entry_t *vmm_get_pte(uint32_t virt_addr);
+
+/**
+ * @brief 获取一个虚拟地址在当前地址空间中的页目录项
+ */
+page_directory_entry_t *vmm_get_pde(uint32_t virt_addr);
+
+/**
+ * @brief 用一个 4MB 大页映射一段按 4MB 对齐的虚拟地址
+ *
+ * 原页表中不得有除共享零页以外的有效映射。原页表的物理地址会被记住，
+ * 以便大页被拆分时重新挂回。
+ *
+ * @param virt_addr 虚拟地址（按 4MB 对齐）
+ * @param phys_addr 物理地址（按 4MB 对齐）
+ * @param flags 权限标志（只支持 PAGE_PRESENT / PAGE_RW）
+ * @return true 映射成功
+ * @return false 页表不存在或仍有 4KB 映射
+ */
+bool_t vmm_map_large_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags);
+
+/**
+ * @brief 将包含 virt_addr 的大页拆分回 1024 个 4KB 页，物理页保持不变
+ *
+ * 对非大页地址调用无任何效果。vmm_map_page / vmm_unmap_page 遇到大页时会自动拆分。
+ */
+void vmm_split_large_page(uint32_t virt_addr);
+
 /**
  * @brief 为一个虚拟地址分配一个物理页并映射
  *
@@ -124,6 +263,17 @@ bool_t vmm_alloc_and_map_page(uint32_t virt_addr, uint32_t flags);
  */
 void vmm_unmap_page(uint32_t virt_addr);
 
+/**
+ * @brief 取消一段虚拟地址的映射，并把其中的物理页归还给 PMM
+ *
+ * 共享零页只解除映射，不会被释放；覆盖该范围的大页会先被拆分。
+ *
+ * @param virt_addr 起始虚拟地址（必须按页对齐）
+ * @param pages 页数
+ * @return uint32_t 实际归还给 PMM 的物理页数
+ */
+uint32_t vmm_release_range(uint32_t virt_addr, uint32_t pages);
+
 /**
  * @brief 获取一个虚拟地址对应的物理地址
  *
@@ -140,6 +290,16 @@ uint32_t vmm_get_phys_addr(uint32_t virt_addr);
  */
 void vmm_switch_page_directory(uint32_t new_directory_phys_addr);
 
+/**
+ * @brief 为新地址空间创建页目录
+ *
+ * 新页目录的用户空间为空，内核空间与当前页目录共享页表，自映射项指向其自身。
+ * 构建过程通过 kmap_atomic() 完成，不占用内核虚拟地址空间。
+ *
+ * @return uint32_t 新页目录的物理地址；物理内存耗尽时返回 0
+ */
+uint32_t vmm_create_page_directory(void);
+
 /**
  * @brief 获取当前页目录的物理地址
  *
@@ -147,11 +307,88 @@ void vmm_switch_page_directory(uint32_t new_directory_phys_addr);
  */
 uint32_t vmm_get_current_directory_phys_addr(void);
 
+/**
+ * @brief 将缓存类型转换为 vmm_map_page() 的 PAGE_CACHE_* 标志
+ *
+ * 若 CPU 不支持 PAT，WC 会退化为 UC。
+ */
+uint32_t vmm_cache_flags(vmm_cache_type_t type);
+
+/**
+ * @brief 修改一段已映射虚拟地址区间的缓存类型
+ *
+ * @param virt_addr 起始虚拟地址
+ * @param size 区间大小（字节）
+ * @param type 新的缓存类型
+ */
+void vmm_set_cache_type(uint32_t virt_addr, uint32_t size, vmm_cache_type_t type);
+
+/**
+ * @brief 将一段设备物理内存映射到内核虚拟地址空间
+ *
+ * 映射位于 [IOREMAP_START, IOREMAP_END) 窗口内，不占用物理页。
+ *
+ * @param paddr 物理地址（无需页对齐，返回值保留页内偏移）
+ * @param size 区间大小（字节）
+ * @param cache_type 缓存类型，帧缓冲用 VMM_CACHE_WC，寄存器用 VMM_CACHE_UC
+ * @return void* 对应的虚拟地址；窗口耗尽时返回 NULL
+ */
+void *ioremap(uint32_t paddr, uint32_t size, vmm_cache_type_t cache_type);
+
+/**
+ * @brief 解除 ioremap() 建立的映射并归还虚拟地址
+ *
+ * @param vaddr ioremap() 的返回值
+ * @param size 映射时传入的大小
+ */
+void iounmap(void *vaddr, uint32_t size);
+
+/**
+ * @brief 注册一段虚拟内存区域
+ *
+ * 区域之间不得重叠。落在匿名区域内的缺页按“共享零页 + 写时分配”处理；
+ * 落在非匿名区域内的缺页视为内核错误。
+ *
+ * @param name 区域名称（用于调试输出，须为静态字符串）
+ * @param start 起始虚拟地址（必须按页对齐）
+ * @param end 结束虚拟地址（不含，必须按页对齐）
+ * @param flags 区域标志 (VMM_REGION_*)
+ * @return true 注册成功
+ * @return false 区域表已满或参数非法
+ */
+bool_t vmm_region_register(const char *name, uint32_t start, uint32_t end, uint32_t flags);
+
+/**
+ * @brief 查找包含指定虚拟地址的区域
+ *
+ * @param virt_addr 虚拟地址
+ * @return vmm_region_t* 所在区域；不属于任何已注册区域时返回 NULL
+ */
+vmm_region_t *vmm_region_find(uint32_t virt_addr);
+
+/**
+ * @brief 按下标获取已注册的区域
+ *
+ * @param index 区域下标 [0, VMM_MAX_REGIONS)
+ * @return vmm_region_t* 区域；下标处尚未注册时返回 NULL
+ */
+vmm_region_t *vmm_region_get(uint32_t index);
+
+/**
+ * @brief 获取共享零页的物理地址
+ *
+ * 共享零页是一个内容恒为 0 的物理页，匿名区域的读缺页都以只读方式映射到它。
+ */
+uint32_t vmm_zero_page_phys(void);
+
 /**
  * @brief Page Fault (中断 14) 的处理程序
  *
  * 当 CPU 访问一个未映射的页面时，会调用此函数。
- * 本实现采用按需分页策略，为故障地址分配物理页并建立映射。
+ * 本实现采用按需分页策略：
+ * - 匿名区域内的读缺页只读映射共享零页，不消耗物理页；
+ * - 匿名区域内的写缺页（包括写共享零页）才分配并清零一个新物理页；
+ * - 未注册区域沿用旧行为，直接分配物理页。
  *
  * @param frame 指向中断发生时 CPU 上下文的指针
  */
@@ -11,6 +11,7 @@
 typedef struct yieldlock
 {
     volatile uint32_t lock;
+    volatile uint32_t contended; // times the lock was found held on the first try
 } yieldlock_t;
 
 // ****************************************************************************
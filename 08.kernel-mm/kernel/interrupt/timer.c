@@ -6,6 +6,9 @@
 
 uint32_t tick = 0;
 
+static timer_hook_t hooks[TIMER_MAX_HOOKS];
+static uint32_t hook_num = 0;
+
 uint32_t getTick()
 {
     return tick;
@@ -15,6 +18,20 @@ static void timer_callback(interrupt_frame_t *regs)
 {
     tick++;
     // vga_printf("tick=%d\n", tick);
+    for (uint32_t i = 0; i < hook_num; i++)
+    {
+        hooks[i](tick);
+    }
+}
+
+uint32_t timer_add_hook(timer_hook_t hook)
+{
+    if (hook_num >= TIMER_MAX_HOOKS)
+    {
+        return 0;
+    }
+    hooks[hook_num++] = hook;
+    return 1;
 }
 
 void init_timer(uint32_t frequency)
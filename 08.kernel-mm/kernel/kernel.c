@@ -6,6 +6,12 @@
 #include "pmm.h"
 #include "vmm.h"
 #include "kheap.h"
+#include "kheap_trace.h"
+#include "page_idle.h"
+#include "thp.h"
+#include "vmalloc.h"
+#include "slab.h"
+#include "arena.h"
 
 void main()
 {
@@ -20,11 +26,32 @@ void main()
   // boot_info_dump();
   pmm_init(&boot_info);
   vmm_init();
+  vmalloc_init();
   init_kheap();
+  kmem_cache_init();
+  page_idle_init();
 
   // 用随机、碎片化、高频率的分配-释放序列反复测试堆分配器，若失败则会立即 PANIC
   kheap_killer();
+  kheap_realloc_test();
+  kheap_quick_test();
+  kheap_align_test();
+  kheap_contract_test();
+  kheap_zero_test();
+  kheap_arena_test();
+  kheap_large_test();
+  kheap_atomic_test();
+  kheap_stats_test();
+  // 回放一段合成的分配序列，报告堆的吞吐、延迟和峰值占用
+  kheap_bench();
+  slab_test();
+  arena_test();
 
+  // 空闲循环：做一些后台内存整理，然后等待下一次中断
   while (1)
-    ;
+  {
+    thp_khugepaged();
+    kheap_reclaim(KHEAP_CONTRACT_DELAY);
+    __asm__ volatile("hlt");
+  }
 }
@@ -0,0 +1,70 @@
+#include "ptr_table.h"
+#include "string.h"
+
+static inline uint32_t *slot_entry(ptr_table_t *this, uint32_t i)
+{
+    return (uint32_t *)((uint8_t *)this->entries + i * this->entry_size);
+}
+
+// Fibonacci hashing of the key without its always-zero low bits.
+static inline uint32_t home_slot(ptr_table_t *this, uint32_t key)
+{
+    return (((key >> this->shift) * 2654435761U) >> 16) & (this->slots - 1);
+}
+
+void ptr_table_clear(ptr_table_t *this)
+{
+    memset(this->entries, 0, this->slots * this->entry_size);
+    this->count = 0;
+}
+
+void *ptr_table_insert(ptr_table_t *this, uint32_t key)
+{
+    if (ptr_table_full(this))
+    {
+        return NULL;
+    }
+    uint32_t i = home_slot(this, key);
+    while (*slot_entry(this, i) != 0)
+    {
+        i = (i + 1) & (this->slots - 1);
+    }
+    uint32_t *entry = slot_entry(this, i);
+    *entry = key;
+    this->count++;
+    return entry;
+}
+
+void *ptr_table_find(ptr_table_t *this, uint32_t key)
+{
+    for (uint32_t i = home_slot(this, key); *slot_entry(this, i) != 0; i = (i + 1) & (this->slots - 1))
+    {
+        if (*slot_entry(this, i) == key)
+        {
+            return slot_entry(this, i);
+        }
+    }
+    return NULL;
+}
+
+void ptr_table_remove(ptr_table_t *this, void *entry)
+{
+    uint32_t mask = this->slots - 1;
+    uint32_t hole = ((uint8_t *)entry - (uint8_t *)this->entries) / this->entry_size;
+    *slot_entry(this, hole) = 0;
+    this->count--;
+
+    // Move back entries that probed past the freed slot, so that lookups
+    // never stop early at it.
+    for (uint32_t j = (hole + 1) & mask; *slot_entry(this, j) != 0; j = (j + 1) & mask)
+    {
+        uint32_t home = home_slot(this, *slot_entry(this, j));
+        // Entry j may move to hole unless its home lies cyclically in (hole, j].
+        if (((j - home) & mask) >= ((j - hole) & mask))
+        {
+            memcpy(slot_entry(this, hole), slot_entry(this, j), this->entry_size);
+            *slot_entry(this, j) = 0;
+            hole = j;
+        }
+    }
+}
@@ -8,6 +8,24 @@ void *memset(void *dest, int val, size_t len)
     return dest;
 }
 
+// Clear len bytes. The aligned middle is cleared a word at a time with
+// rep stosl, which is far faster than the byte loop of memset.
+void *memzero(void *dest, size_t len)
+{
+    unsigned char *ptr = dest;
+    while (len > 0 && ((uintptr_t)ptr & 3) != 0)
+    {
+        *ptr++ = 0;
+        len--;
+    }
+    unsigned long words = len / 4;
+    asm volatile("rep stosl" : "+D"(ptr), "+c"(words) : "a"(0) : "memory");
+    len &= 3;
+    while (len--)
+        *ptr++ = 0;
+    return dest;
+}
+
 void *memcpy(void *dest, const void *src, size_t len)
 {
     unsigned char *d = dest;
@@ -0,0 +1,188 @@
+/**
+ * @file arena.c
+ * @brief 区域（arena）分配器实现
+ */
+
+#include "arena.h"
+#include "vmalloc.h"
+#include "vmm.h"
+#include "vga.h"
+#include "string.h"
+
+#define CHUNK_HEADER_SIZE ALIGN_UP(sizeof(arena_chunk_t), ARENA_ALIGN)
+#define ARENA_DESC_SIZE ALIGN_UP(sizeof(arena_t), ARENA_ALIGN)
+// 不超过它的 size 按 ARENA_ALIGN 对齐、加上 chunk 头再按页对齐都不会溢出
+#define ARENA_ALLOC_MAX (0xFFFFFFFF - CHUNK_HEADER_SIZE - PAGE_SIZE - ARENA_ALIGN)
+
+static inline uint32_t chunk_data(arena_chunk_t *chunk)
+{
+    return (uint32_t)chunk + CHUNK_HEADER_SIZE;
+}
+
+static inline uint32_t chunk_end(arena_chunk_t *chunk)
+{
+    return (uint32_t)chunk + chunk->pages * PAGE_SIZE;
+}
+
+static arena_chunk_t *chunk_alloc(uint32_t pages)
+{
+    arena_chunk_t *chunk = (arena_chunk_t *)vmalloc_pages(pages, 1);
+    if (chunk != NULL)
+    {
+        chunk->next = NULL;
+        chunk->pages = pages;
+    }
+    return chunk;
+}
+
+/**
+ * @brief 让 arena 在一个能放下 size 字节的 chunk 上继续分配
+ *
+ * 先复用 reset 之前留下的 chunk（放不下的跳过，等下次 reset 再用），
+ * 都不合适时在链表末尾追加一个新 chunk。size 不超过 ARENA_ALLOC_MAX。
+ */
+static bool_t arena_next_chunk(arena_t *arena, uint32_t size)
+{
+    uint32_t need = CHUNK_HEADER_SIZE + size;
+    arena_chunk_t *prev = arena->current;
+    while (prev->next != NULL && chunk_end(prev->next) - chunk_data(prev->next) < size)
+    {
+        prev = prev->next;
+    }
+
+    arena_chunk_t *chunk = prev->next;
+    if (chunk == NULL)
+    {
+        uint32_t pages = MAX(arena->chunk_pages, (uint32_t)ALIGN_UP(need, PAGE_SIZE) / PAGE_SIZE);
+        chunk = chunk_alloc(pages);
+        if (chunk == NULL)
+        {
+            return false;
+        }
+        prev->next = chunk;
+        arena->chunks++;
+    }
+
+    arena->current = chunk;
+    arena->cur = chunk_data(chunk);
+    arena->end = chunk_end(chunk);
+    return true;
+}
+
+// ====================================================================
+// 公共接口
+// ====================================================================
+
+arena_t *arena_create(uint32_t chunk_pages)
+{
+    if (chunk_pages == 0)
+    {
+        chunk_pages = 1;
+    }
+    arena_chunk_t *first = chunk_alloc(chunk_pages);
+    if (first == NULL)
+    {
+        return NULL;
+    }
+
+    arena_t *arena = (arena_t *)chunk_data(first);
+    arena->first = first;
+    arena->chunk_pages = chunk_pages;
+    arena->chunks = 1;
+    arena_reset(arena);
+    return arena;
+}
+
+void *arena_alloc(arena_t *arena, uint32_t size)
+{
+    if (size == 0 || size > ARENA_ALLOC_MAX)
+    {
+        return NULL;
+    }
+    size = ALIGN_UP(size, ARENA_ALIGN);
+    // end 按页对齐，cur 按 ARENA_ALIGN 对齐，所以 end - cur 不会下溢
+    if (arena->end - arena->cur < size && !arena_next_chunk(arena, size))
+    {
+        return NULL;
+    }
+
+    void *ptr = (void *)arena->cur;
+    arena->cur += size;
+    arena->used += size;
+    return ptr;
+}
+
+void arena_reset(arena_t *arena)
+{
+    arena->current = arena->first;
+    arena->cur = chunk_data(arena->first) + ARENA_DESC_SIZE;
+    arena->end = chunk_end(arena->first);
+    arena->used = 0;
+}
+
+void arena_destroy(arena_t *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    // 描述符在第一个 chunk 里，最后释放它
+    arena_chunk_t *chunk = arena->first->next;
+    while (chunk != NULL)
+    {
+        arena_chunk_t *next = chunk->next;
+        vfree_pages(chunk, chunk->pages);
+        chunk = next;
+    }
+    arena_chunk_t *first = arena->first;
+    vfree_pages(first, first->pages);
+}
+
+// ******************************** unit tests **********************************
+void arena_test()
+{
+    vga_printf("arena test ... ");
+    uint32_t vmalloc_before = vmalloc_used_pages();
+
+    arena_t *arena = arena_create(1);
+    ASSERT(arena != NULL && arena->chunks == 1);
+
+    // Fill several chunks with small objects; they are aligned and never overlap.
+    uint32_t num = 3 * PAGE_SIZE / 48;
+    uint8_t *objs[num];
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[i] = (uint8_t *)arena_alloc(arena, 40);
+        ASSERT(objs[i] != NULL && ((uint32_t)objs[i] & (ARENA_ALIGN - 1)) == 0);
+        memset(objs[i], (uint8_t)i, 40);
+    }
+    for (uint32_t i = 0; i < num; i++)
+    {
+        ASSERT(objs[i][0] == (uint8_t)i && objs[i][39] == (uint8_t)i);
+    }
+    ASSERT(arena->chunks >= 3 && arena->used == num * 48);
+
+    // A request larger than a chunk gets a chunk of its own.
+    uint8_t *big = (uint8_t *)arena_alloc(arena, 3 * PAGE_SIZE);
+    ASSERT(big != NULL);
+    big[3 * PAGE_SIZE - 1] = 1;
+    uint32_t chunks = arena->chunks;
+
+    // After a reset the same memory is handed out again, without new chunks.
+    arena_reset(arena);
+    ASSERT(arena->used == 0);
+    for (uint32_t i = 0; i < num; i++)
+    {
+        ASSERT(arena_alloc(arena, 40) == objs[i]);
+    }
+    ASSERT(arena_alloc(arena, 3 * PAGE_SIZE) == big);
+    ASSERT(arena->chunks == chunks);
+    ASSERT(arena_alloc(arena, 0) == NULL);
+    // Sizes whose rounding would wrap around are refused, not turned into small ones.
+    ASSERT(arena_alloc(arena, 0xFFFFFFF1) == NULL && arena_alloc(arena, 0xFFFFFFFF - PAGE_SIZE) == NULL);
+    ASSERT(arena->chunks == chunks);
+
+    arena_destroy(arena);
+    ASSERT(vmalloc_used_pages() == vmalloc_before);
+    vga_printf("OK\n");
+}
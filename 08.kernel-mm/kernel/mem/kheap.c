@@ -1,359 +1,1944 @@
 #include "vga.h"
 #include "vmm.h"
+#include "pmm.h"
 #include "kheap.h"
 #include "yieldlock.h"
 #include "rand.h"
+#include "string.h"
+#include "timer.h"
+#include "cpu.h"
+#include "lock.h"
+#include "vmalloc.h"
+#include "kheap_profile.h"
+#include "kheap_trace.h"
+#include "ptr_table.h"
 
-static kheap_t kheap;
-static yieldlock_t kheap_lock;
+// Each arena is a kheap_t over its own KHEAP_ARENA_SPAN slice of the heap
+// range, with its own locks and magazine depots. Lock order inside an arena:
+// depot -> expand_lock -> lock.
+static kheap_t arenas[KHEAP_ARENA_COUNT];
+
+// Every CPU holds two magazines per class; each depot can hold at most
+// KHEAP_DEPOT_MAX_FULL full ones per class and starts with as many empty ones.
+// Trades swap one for one, so a depot never runs out of empty magazines while
+// it is below its limit.
+#define KHEAP_MAG_POOL_SIZE ((NR_CPUS * 2 + KHEAP_ARENA_COUNT * KHEAP_DEPOT_MAX_FULL) * KHEAP_MAG_CLASS_COUNT)
+
+static kheap_cpu_cache_t cpu_caches[NR_CPUS];
+static kheap_magazine_t magazine_pool[KHEAP_MAG_POOL_SIZE];
+
+// Large allocations: addr == 0 marks a free slot.
+typedef struct kheap_large
+{
+    uint32_t addr;
+    uint32_t pages;
+} kheap_large_t;
+
+static kheap_large_t large_table[KHEAP_LARGE_TABLE_SIZE];
+static ptr_table_t large_map = PTR_TABLE_INIT(large_table, PAGE_SHIFT);
+static uint32_t large_pages;
+static yieldlock_t large_lock;
+STATIC_ASSERT((KHEAP_LARGE_TABLE_SIZE & (KHEAP_LARGE_TABLE_SIZE - 1)) == 0, "large_table_size_must_be_a_power_of_two");
 
 #define HEADER_SIZE (sizeof(kheap_block_header_t))
 #define FOOTER_SIZE (sizeof(kheap_block_footer_t))
-#define BLOCK_META_SIZE (sizeof(kheap_block_header_t) + sizeof(kheap_block_footer_t))
 
-#define IS_HOLE 1
-#define NOT_HOLE 0
+// Smallest block: a hole holds its header, the free list links and its footer.
+#define MIN_BLOCK_SIZE ALIGN_UP(HEADER_SIZE + sizeof(kheap_free_links_t) + FOOTER_SIZE, KHEAP_ALIGN)
+// Bytes a new hole writes at its start.
+#define HOLE_META_SIZE (HEADER_SIZE + sizeof(kheap_free_links_t))
+
+// Payloads start on a KHEAP_ALIGN boundary and blocks are a multiple of
+// KHEAP_ALIGN long, so block headers sit HEADER_SIZE before an aligned address.
+// The heap range is page aligned, so the blocks cover
+// [start_address + BLOCK_LEAD, end_address - BLOCK_TAIL), and the epilogue
+// header fills the BLOCK_TAIL bytes after them.
+STATIC_ASSERT(HEADER_SIZE < KHEAP_ALIGN, "block_header_must_fit_in_front_of_an_aligned_payload");
+#define BLOCK_LEAD (KHEAP_ALIGN - HEADER_SIZE)
+#define BLOCK_TAIL HEADER_SIZE
+
+// Holes an aligned allocation inspects before it gives up and grows the heap.
+#define ALIGNED_FIT_SCAN_MAX 32
+
+#define IN_USE KHEAP_BLOCK_IN_USE
+#define PREV_IN_USE KHEAP_BLOCK_PREV_IN_USE
+
+static uint32_t align_to_page(uint32_t num)
+{
+    if ((num & 0xFFF) != 0)
+    {
+        return (num & 0xFFFFF000) + PAGE_SIZE;
+    }
+    return num;
+}
+
+static inline uint32_t align_up(uint32_t num, uint32_t align)
+{
+    return (num + align - 1) & ~(align - 1);
+}
+
+static inline uint32_t blocks_start(kheap_t *this)
+{
+    return this->start_address + BLOCK_LEAD;
+}
+
+static inline uint32_t blocks_end(kheap_t *this)
+{
+    return this->end_address - BLOCK_TAIL;
+}
+
+static void kheap_record_footprint(kheap_t *this)
+{
+    kheap_footprint_t *fp = &this->footprint;
+    if (this->size > fp->peak_size)
+    {
+        fp->peak_size = this->size;
+    }
+    kheap_footprint_sample_t *sample = &fp->history[fp->history_num % KHEAP_FOOTPRINT_HISTORY];
+    sample->tick = getTick();
+    sample->size = this->size;
+    fp->history_num++;
+}
+
+// Back [start, start + pages * PAGE_SIZE) with zeroed frames before the heap
+// touches it, instead of taking one page fault per page. Pages that already
+// have a real frame (e.g. inside a huge page) are left alone. If the PMM cannot
+// supply the whole batch, the range simply stays lazily backed. Returns the
+// number of frames mapped. The caller holds this->expand_lock, which guards
+// the frame batch.
+static uint32_t kheap_populate(kheap_t *this, uint32_t start, uint32_t pages)
+{
+    uint32_t *frames = this->populate_frames;
+    uint32_t needed = 0;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        uint32_t pa = vmm_get_phys_addr(start + i * PAGE_SIZE);
+        if (pa == 0 || (pa & 0xFFFFF000) == vmm_zero_page_phys())
+        {
+            needed++;
+        }
+    }
+    if (needed == 0 || !pmm_alloc_pages(frames, needed))
+    {
+        return 0;
+    }
+
+    // Spread the batch over the pages that need a frame, back to front so the
+    // array can be expanded in place; 0 tells vmm_map_range to skip a page.
+    uint32_t next = needed;
+    for (uint32_t i = pages; i > 0; i--)
+    {
+        uint32_t pa = vmm_get_phys_addr(start + (i - 1) * PAGE_SIZE);
+        bool_t fill = (pa == 0 || (pa & 0xFFFFF000) == vmm_zero_page_phys());
+        frames[i - 1] = fill ? frames[--next] : 0;
+    }
+    ASSERT(next == 0);
+
+    bool_t mapped = vmm_map_range(start, frames, pages, PAGE_KERNEL_FLAGS);
+    ASSERT(mapped);
+    (void)mapped;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        if (frames[i] != 0)
+        {
+            memzero((void *)(start + i * PAGE_SIZE), PAGE_SIZE);
+        }
+    }
+    return needed;
+}
+
+// Move end_address forward. The caller holds both expand_lock and lock.
+static uint32_t kheap_expand(kheap_t *this, uint32_t expand_size)
+{
+    ASSERT((expand_size & 0xFFF) == 0);
+    if (expand_size == 0)
+    {
+        return 0;
+    }
+
+    uint32_t new_end = this->end_address + expand_size;
+    ASSERT(new_end <= this->max_address);
+    this->end_address = new_end;
+    this->size = this->size + expand_size;
+    this->footprint.expands++;
+    this->footprint.expand_tick = getTick();
+    kheap_record_footprint(this);
+    return expand_size;
+}
+
+// Cut contract_size bytes off the end of the heap, unmap them and give their
+// frames back to the PMM. The caller must already have shrunk the last hole,
+// and holds both expand_lock and lock.
+static uint32_t kheap_contract(kheap_t *this, uint32_t contract_size)
+{
+    ASSERT((contract_size & 0xFFF) == 0);
+    if (this->size - contract_size < KHEAP_MIN_SIZE)
+    {
+        contract_size = this->size - KHEAP_MIN_SIZE;
+    }
+    if (contract_size == 0)
+    {
+        return 0;
+    }
+
+    uint32_t new_end = this->end_address - contract_size;
+    this->footprint.released_pages += vmm_release_range(new_end, contract_size / PAGE_SIZE);
+    this->end_address = new_end;
+    this->size -= contract_size;
+    this->footprint.contracts++;
+    kheap_record_footprint(this);
+    return contract_size;
+}
+
+static inline uint32_t block_size(kheap_block_header_t *header)
+{
+    return header->size & ~KHEAP_BLOCK_FLAGS;
+}
+
+static inline bool_t block_in_use(kheap_block_header_t *header)
+{
+    return (header->size & IN_USE) != 0;
+}
+
+static inline bool_t prev_in_use(kheap_block_header_t *header)
+{
+    return (header->size & PREV_IN_USE) != 0;
+}
+
+static inline kheap_block_header_t *block_next(kheap_block_header_t *header)
+{
+    return (kheap_block_header_t *)((uint32_t)header + block_size(header));
+}
+
+// The block on the left, found through its footer. Only holes have one.
+static inline kheap_block_header_t *block_prev(kheap_block_header_t *header)
+{
+    ASSERT(!prev_in_use(header));
+    kheap_block_footer_t *footer = (kheap_block_footer_t *)((uint32_t)header - FOOTER_SIZE);
+    return (kheap_block_header_t *)((uint32_t)header - footer->size);
+}
+
+// Write the header of a block of size bytes at start, plus the footer if it is
+// a hole, and update the PREV_IN_USE bit of the block after it, whose header
+// must be in place already.
+static kheap_block_header_t *make_block(uint32_t start, uint32_t size, uint32_t flags)
+{
+    ASSERT(size >= MIN_BLOCK_SIZE && (size & KHEAP_BLOCK_FLAGS) == 0);
+    ASSERT(((start + HEADER_SIZE) & (KHEAP_ALIGN - 1)) == 0);
+
+    kheap_block_header_t *block_header = (kheap_block_header_t *)start;
+    block_header->size = size | flags;
+
+    kheap_block_header_t *next_header = (kheap_block_header_t *)(start + size);
+    if (flags & IN_USE)
+    {
+        next_header->size |= PREV_IN_USE;
+    }
+    else
+    {
+        kheap_block_footer_t *block_footer = (kheap_block_footer_t *)(start + size - FOOTER_SIZE);
+        block_footer->size = size;
+        next_header->size &= ~PREV_IN_USE;
+    }
+    return block_header;
+}
+
+// The epilogue is a header of size 0 that is always in use, so the last block
+// needs no bounds check to look at its right neighbour. make_block() of the
+// last block sets its PREV_IN_USE bit.
+static inline void make_epilogue(uint32_t start)
+{
+    ((kheap_block_header_t *)start)->size = IN_USE;
+}
+
+// ******************************** zero area ***********************************
+// Everything below end may have been written: the known zero area starts after
+// it. Moving zero_start forward is always safe, it only costs kzalloc clears.
+// Caller holds this->lock.
+static inline void zero_area_claim(kheap_t *this, uint32_t end)
+{
+    if (end > this->zero_start)
+    {
+        this->zero_start = end;
+    }
+}
+
+// Bytes at the start of the payload [pos, pos + len) that may not be zero.
+static inline uint32_t zero_area_dirty(kheap_t *this, uint32_t pos, uint32_t len)
+{
+    // The zero area ends before the footer of the last hole.
+    if (pos + len > blocks_end(this) - FOOTER_SIZE)
+    {
+        return len;
+    }
+    return pos >= this->zero_start ? 0 : MIN(this->zero_start - pos, len);
+}
+
+// ******************************** free lists **********************************
+static inline kheap_free_links_t *block_links(kheap_block_header_t *header)
+{
+    return (kheap_free_links_t *)((uint32_t)header + HEADER_SIZE);
+}
+
+// Index of the most significant set bit.
+static inline uint32_t bit_fls(uint32_t word)
+{
+    return 31 - __builtin_clz(word);
+}
+
+// Index of the least significant set bit.
+static inline uint32_t bit_ffs(uint32_t word)
+{
+    return __builtin_ctz(word);
+}
+
+// Map a hole size to the list it is kept in.
+static void mapping_insert(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+    if (size < KHEAP_SMALL_BLOCK_SIZE)
+    {
+        *fl = 0;
+        *sl = size / (KHEAP_SMALL_BLOCK_SIZE / KHEAP_SL_INDEX_COUNT);
+    }
+    else
+    {
+        uint32_t f = bit_fls(size);
+        *sl = (size >> (f - KHEAP_SL_INDEX_COUNT_LOG2)) ^ KHEAP_SL_INDEX_COUNT;
+        *fl = f - (KHEAP_FL_INDEX_SHIFT - 1);
+    }
+    ASSERT(*fl < KHEAP_FL_INDEX_COUNT);
+}
+
+// Map a request size to the first list whose holes are all large enough.
+// The size is rounded up to the next class boundary, so any hole found from
+// there on fits without walking the list.
+static void mapping_search(uint32_t size, uint32_t *fl, uint32_t *sl)
+{
+    if (size >= KHEAP_SMALL_BLOCK_SIZE)
+    {
+        size += (1 << (bit_fls(size) - KHEAP_SL_INDEX_COUNT_LOG2)) - 1;
+    }
+    else
+    {
+        size += (KHEAP_SMALL_BLOCK_SIZE / KHEAP_SL_INDEX_COUNT) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static void insert_hole(kheap_t *this, kheap_block_header_t *header)
+{
+    ASSERT(!block_in_use(header) && prev_in_use(header));
+    uint32_t fl, sl;
+    mapping_insert(block_size(header), &fl, &sl);
+
+    kheap_block_header_t *head = this->free_lists[fl][sl];
+    block_links(header)->next = head;
+    block_links(header)->prev = NULL;
+    if (head != NULL)
+    {
+        block_links(head)->prev = header;
+    }
+    this->free_lists[fl][sl] = header;
+    this->fl_bitmap |= (1 << fl);
+    this->sl_bitmap[fl] |= (1 << sl);
+    this->hole_count++;
+    this->hole_bytes += block_size(header) - HEADER_SIZE;
+}
+
+static void remove_hole(kheap_t *this, kheap_block_header_t *header)
+{
+    uint32_t fl, sl;
+    mapping_insert(block_size(header), &fl, &sl);
+
+    kheap_block_header_t *next = block_links(header)->next;
+    kheap_block_header_t *prev = block_links(header)->prev;
+    if (next != NULL)
+    {
+        block_links(next)->prev = prev;
+    }
+    if (prev != NULL)
+    {
+        block_links(prev)->next = next;
+    }
+    else
+    {
+        ASSERT(this->free_lists[fl][sl] == header);
+        this->free_lists[fl][sl] = next;
+    }
+
+    if (this->free_lists[fl][sl] == NULL)
+    {
+        this->sl_bitmap[fl] &= ~(1 << sl);
+        if (this->sl_bitmap[fl] == 0)
+        {
+            this->fl_bitmap &= ~(1 << fl);
+        }
+    }
+    this->hole_count--;
+    this->hole_bytes -= block_size(header) - HEADER_SIZE;
+}
+
+kheap_t create_kheap(uint32_t start, uint32_t end, uint32_t max, uint8_t supervisor, uint8_t readonly)
+{
+    ASSERT((start & 0xFFF) == 0);
+    ASSERT((end & 0xFFF) == 0);
+
+    kheap_t kheap;
+    memset(&kheap, 0, sizeof(kheap_t));
+    yieldlock_init(&kheap.lock);
+    yieldlock_init(&kheap.expand_lock);
+
+    // Write the start, end and max addresses into the heap structure.
+    kheap.start_address = start;
+    kheap.end_address = end;
+    kheap.size = end - start;
+    kheap.max_address = max;
+    kheap.supervisor = supervisor;
+    kheap.readonly = readonly;
+
+    // Start off with one large hole. Nothing is on its left, which counts as in use.
+    make_epilogue(blocks_end(&kheap));
+    insert_hole(&kheap, make_block(blocks_start(&kheap), blocks_end(&kheap) - blocks_start(&kheap), PREV_IN_USE));
+    kheap.zero_start = blocks_start(&kheap) + HOLE_META_SIZE;
+    kheap.footprint.peak_size = kheap.size;
+
+    return kheap;
+}
+
+// Find a hole that fits requested size: take the head of the first non-empty
+// list at or above the size class of the request. Both bitmap lookups are
+// constant time, so this does not depend on the number of holes.
+static kheap_block_header_t *find_hole(kheap_t *this, uint32_t size)
+{
+    uint32_t fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= KHEAP_FL_INDEX_COUNT)
+    {
+        return NULL;
+    }
+
+    uint32_t sl_map = this->sl_bitmap[fl] & (~0U << sl);
+    if (sl_map == 0)
+    {
+        // Nothing left in this first level, go to the next larger one.
+        uint32_t fl_map = this->fl_bitmap & (~0U << (fl + 1));
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
+        fl = bit_ffs(fl_map);
+        sl_map = this->sl_bitmap[fl];
+    }
+    sl = bit_ffs(sl_map);
+
+    kheap_block_header_t *header = this->free_lists[fl][sl];
+    ASSERT(header != NULL && block_size(header) >= size);
+    return header;
+}
+
+// Expand the heap by at least grow_size bytes and add the new space to the
+// last block: the last hole grows, or a new hole is appended after the last
+// allocated block. Called without this->lock held; seen_end is end_address as
+// the caller saw it when it ran out of space. If the heap has changed size
+// since, the caller just retries. Returns 0 if the arena cannot grow that far.
+static bool_t kheap_grow(kheap_t *this, uint32_t grow_size, uint32_t seen_end)
+{
+    yieldlock_lock(&this->expand_lock);
+    uint32_t old_end_address = this->end_address;
+    if (old_end_address != seen_end)
+    {
+        yieldlock_unlock(&this->expand_lock);
+        return 1;
+    }
+
+    uint32_t extended_size = align_to_page(grow_size);
+    if (extended_size < grow_size || extended_size > this->max_address - old_end_address)
+    {
+        yieldlock_unlock(&this->expand_lock);
+        return 0;
+    }
+
+    // Nothing else touches the pages past end_address, so they are backed
+    // without holding this->lock.
+    uint32_t eager_pages = 0;
+    if (extended_size / PAGE_SIZE <= KHEAP_EAGER_MAX_PAGES)
+    {
+        eager_pages = kheap_populate(this, old_end_address, extended_size / PAGE_SIZE);
+    }
+
+    yieldlock_lock(&this->lock);
+    this->footprint.eager_pages += eager_pages;
+    kheap_expand(this, extended_size);
+    make_epilogue(blocks_end(this));
+
+    kheap_block_header_t *old_epilogue = (kheap_block_header_t *)(old_end_address - BLOCK_TAIL);
+    if (!prev_in_use(old_epilogue))
+    {
+        // Extend the last hole. Note after extension, it needs to be taken out and re-inserted
+        // into the free lists since its size class may have changed.
+        // The old footer and epilogue end up inside the hole: clear them so
+        // that a zero area reaching them carries on into the new pages.
+        kheap_block_header_t *last_header = block_prev(old_epilogue);
+        memzero((void *)((uint32_t)old_epilogue - FOOTER_SIZE), FOOTER_SIZE + BLOCK_TAIL);
+        remove_hole(this, last_header);
+        make_block((uint32_t)last_header, block_size(last_header) + extended_size, PREV_IN_USE);
+        insert_hole(this, last_header);
+    }
+    else
+    {
+        // Append a new hole in place of the old epilogue.
+        insert_hole(this, make_block((uint32_t)old_epilogue, extended_size, PREV_IN_USE));
+        zero_area_claim(this, (uint32_t)old_epilogue + HOLE_META_SIZE);
+    }
+    yieldlock_unlock(&this->lock);
+    yieldlock_unlock(&this->expand_lock);
+
+    vga_printf("kheap expand size = %d, end_address = %p, max_address = %p \n",
+               extended_size, old_end_address + extended_size, this->max_address);
+    return 1;
+}
+
+// Size of the block for a request of size bytes: the header and the payload,
+// rounded up so that the block after it stays aligned. Allocated blocks have
+// no footer, so that is all the overhead there is.
+static inline uint32_t alloc_block_size(uint32_t size)
+{
+    return MAX(align_up(size + HEADER_SIZE, KHEAP_ALIGN), (uint32_t)MIN_BLOCK_SIZE);
+}
+
+// A hole of this size fits an allocation of the given alignment wherever the
+// hole starts: the aligned position may be up to align - KHEAP_ALIGN bytes
+// further on, after a leading hole of at least MIN_BLOCK_SIZE.
+static inline uint32_t alloc_search_size(uint32_t size, uint32_t align)
+{
+    size = alloc_block_size(size);
+    return align > KHEAP_ALIGN ? size + align - KHEAP_ALIGN + MIN_BLOCK_SIZE : size;
+}
+
+// Where a block of size bytes with the given payload alignment goes in a hole.
+// Returns false if it does not fit there.
+static bool_t aligned_fit(kheap_block_header_t *hole, uint32_t size, uint32_t align, uint32_t *pos)
+{
+    uint32_t payload = (uint32_t)hole + HEADER_SIZE;
+    uint32_t alloc_pos = payload;
+    if ((payload & (align - 1)) != 0)
+    {
+        // The space in front must be large enough to become a hole itself.
+        alloc_pos = align_up(payload + MIN_BLOCK_SIZE, align);
+    }
+    *pos = alloc_pos;
+    return alloc_pos - payload + size <= block_size(hole);
+}
+
+// Find a hole for an aligned allocation. A hole of alloc_search_size() always
+// fits and is found in constant time like any other request. If there is none,
+// smaller holes may still fit when they happen to be placed well, so walk the
+// lists from the class of the bare size up, looking at no more than
+// ALIGNED_FIT_SCAN_MAX holes.
+static kheap_block_header_t *find_aligned_hole(kheap_t *this, uint32_t size, uint32_t align)
+{
+    kheap_block_header_t *header = find_hole(this, alloc_search_size(size, align));
+    if (header != NULL || align <= KHEAP_ALIGN)
+    {
+        return header;
+    }
+
+    uint32_t fl, sl, pos;
+    mapping_search(size, &fl, &sl);
+    uint32_t budget = ALIGNED_FIT_SCAN_MAX;
+    for (; fl < KHEAP_FL_INDEX_COUNT; fl++, sl = 0)
+    {
+        uint32_t sl_map = this->sl_bitmap[fl] & (~0U << sl);
+        while (sl_map != 0)
+        {
+            uint32_t s = bit_ffs(sl_map);
+            sl_map &= sl_map - 1;
+            for (header = this->free_lists[fl][s]; header != NULL; header = block_links(header)->next)
+            {
+                if (aligned_fit(header, size, align, &pos))
+                {
+                    return header;
+                }
+                if (--budget == 0)
+                {
+                    return NULL;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// ******************************** quick bins **********************************
+// Block sizes with a quick bin: those of the requests above the magazine
+// classes, up to KHEAP_QUICK_MAX_SIZE.
+static inline bool_t quick_binnable(uint32_t size)
+{
+    return size > alloc_block_size(KHEAP_MAG_MAX_SIZE) && size <= alloc_block_size(KHEAP_QUICK_MAX_SIZE);
+}
+
+static inline uint32_t quick_bin(uint32_t size)
+{
+    return (size - alloc_block_size(KHEAP_MAG_MAX_SIZE)) / KHEAP_ALIGN - 1;
+}
+
+// Take a deferred block of exactly size bytes. Caller holds this->lock.
+static kheap_block_header_t *quick_pop(kheap_t *this, uint32_t size)
+{
+    kheap_block_header_t **bin = &this->quick_bins[quick_bin(size)];
+    kheap_block_header_t *header = *bin;
+    if (header != NULL)
+    {
+        ASSERT(block_in_use(header) && block_size(header) == size);
+        *bin = block_links(header)->next;
+        this->quick_count--;
+        this->quick_bytes -= size;
+        this->quick_hits++;
+    }
+    return header;
+}
+
+// Returns NULL if no hole fits; the caller then grows the heap with kheap_grow()
+// by alloc_search_size() and tries again. align is a power of
+// two no smaller than KHEAP_ALIGN. If dirty is not NULL, it is set to the
+// number of bytes at the start of the allocation that may not be zero.
+static void *alloc(kheap_t *this, uint32_t size, uint32_t align, uint32_t *dirty)
+{
+    ASSERT(size > 0);
+    ASSERT(align >= KHEAP_ALIGN && (align & (align - 1)) == 0);
+
+    uint32_t request = size;
+    size = alloc_block_size(size);
+    // A deferred block of the same size is handed out again as it is.
+    if (align == KHEAP_ALIGN && quick_binnable(size))
+    {
+        kheap_block_header_t *deferred = quick_pop(this, size);
+        if (deferred != NULL)
+        {
+            if (dirty != NULL)
+            {
+                *dirty = request;
+            }
+            return (void *)((uint32_t)deferred + HEADER_SIZE);
+        }
+    }
+
+    kheap_block_header_t *header = find_aligned_hole(this, size, align);
+    if (header == NULL)
+    {
+        return NULL;
+    }
+
+    uint32_t hole_size = block_size(header);
+    uint32_t alloc_pos;
+    bool_t fits = aligned_fit(header, size, align, &alloc_pos);
+    ASSERT(fits);
+
+    remove_hole(this, header);
+    // If the aligned position is further on, the space in front becomes a new hole.
+    // |..................|..................|..................|  align
+    //    |h| hole    |f|h| data      |h| hole
+    uint32_t alloc_start = alloc_pos - HEADER_SIZE;
+    uint32_t cut_block_size = alloc_start - (uint32_t)header;
+    ASSERT(cut_block_size == 0 || cut_block_size >= MIN_BLOCK_SIZE);
+    hole_size -= cut_block_size;
+    ASSERT(hole_size >= size);
+    uint32_t remain_size = hole_size - size;
+    if (remain_size < MIN_BLOCK_SIZE)
+    {
+        size = hole_size;
+        remain_size = 0;
+    }
+
+    if (dirty != NULL)
+    {
+        *dirty = zero_area_dirty(this, alloc_pos, request);
+        this->zero_skipped += request - *dirty;
+    }
+    // The remainder hole (or the header of the next block) is written as well.
+    zero_area_claim(this, alloc_start + size + HOLE_META_SIZE);
+
+    // Write the blocks back to front, so that make_block() finds the header
+    // after each one in place and never reads a page the hole has not touched.
+    if (remain_size > 0)
+    {
+        insert_hole(this, make_block(alloc_start + size, remain_size, PREV_IN_USE));
+    }
+    make_block(alloc_start, size, cut_block_size > 0 ? IN_USE : IN_USE | PREV_IN_USE);
+    if (cut_block_size > 0)
+    {
+        insert_hole(this, make_block((uint32_t)header, cut_block_size, PREV_IN_USE));
+    }
+
+    // done
+    return (void *)(alloc_pos);
+}
+
+// If hole is the last block, has grown past the contraction threshold and the
+// heap has not grown for idle_ticks ticks, shrink it to
+// KHEAP_CONTRACT_KEEP bytes and give the pages after it back.
+static void kheap_trim(kheap_t *this, kheap_block_header_t *hole, uint32_t idle_ticks)
+{
+    if ((uint32_t)block_next(hole) != blocks_end(this) || block_size(hole) < KHEAP_CONTRACT_THRESHOLD)
+    {
+        return;
+    }
+    if (getTick() - this->footprint.expand_tick < idle_ticks)
+    {
+        return;
+    }
+
+    uint32_t new_end = align_to_page((uint32_t)hole + KHEAP_CONTRACT_KEEP + BLOCK_TAIL);
+    if (new_end < this->start_address + KHEAP_MIN_SIZE)
+    {
+        new_end = this->start_address + KHEAP_MIN_SIZE;
+    }
+    if (new_end >= this->end_address)
+    {
+        return;
+    }
+
+    // An expansion in progress is populating the pages past end_address; skip
+    // contraction this time rather than wait for it under this->lock.
+    if (!yieldlock_trylock(&this->expand_lock))
+    {
+        return;
+    }
+    remove_hole(this, hole);
+    make_epilogue(new_end - BLOCK_TAIL);
+    make_block((uint32_t)hole, new_end - BLOCK_TAIL - (uint32_t)hole, PREV_IN_USE);
+    insert_hole(this, hole);
+    kheap_contract(this, this->end_address - new_end);
+    // The released pages read as zero again once the heap grows back over them.
+    if (this->zero_start > new_end)
+    {
+        this->zero_start = new_end;
+    }
+    yieldlock_unlock(&this->expand_lock);
+}
+
+static void free(kheap_t *this, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE);
+    uint32_t size = block_size(header);
+    kheap_block_header_t *right_header = block_next(header);
+    // A block that is not in use (or a pointer that is no block at all) does
+    // not have a right neighbour that knows it as in use.
+    ASSERT(block_in_use(header) && size >= MIN_BLOCK_SIZE);
+    ASSERT((uint32_t)right_header <= blocks_end(this) && prev_in_use(right_header));
+
+    // Merge with right. The epilogue is never a hole.
+    if (!block_in_use(right_header))
+    {
+        remove_hole(this, right_header);
+        size += block_size(right_header);
+    }
+
+    // Merge with left.
+    if (!prev_in_use(header))
+    {
+        kheap_block_header_t *left_header = block_prev(header);
+        remove_hole(this, left_header);
+        size += block_size(left_header);
+        header = left_header;
+    }
+
+    // Holes are always merged, so the block on the left of one is in use.
+    insert_hole(this, make_block((uint32_t)header, size, PREV_IN_USE));
+    kheap_trim(this, header, KHEAP_CONTRACT_DELAY);
+}
+
+// Free every block waiting in the quick bins, merging it with its neighbours.
+// Caller holds this->lock.
+static void quick_flush(kheap_t *this)
+{
+    if (this->quick_count == 0)
+    {
+        return;
+    }
+    for (uint32_t b = 0; b < KHEAP_QUICK_BIN_COUNT; b++)
+    {
+        kheap_block_header_t *header = this->quick_bins[b];
+        this->quick_bins[b] = NULL;
+        while (header != NULL)
+        {
+            // Deferred blocks are not holes, so free() never merges the next one away.
+            kheap_block_header_t *next = block_links(header)->next;
+            free(this, (void *)((uint32_t)header + HEADER_SIZE));
+            header = next;
+        }
+    }
+    this->quick_count = 0;
+    this->quick_bytes = 0;
+    this->quick_flushes++;
+}
+
+// Free a block, or defer it to its quick bin if its size has one. Caller
+// holds this->lock.
+static void quick_free(kheap_t *this, void *ptr)
+{
+    kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE);
+    ASSERT(block_in_use(header));
+    uint32_t size = block_size(header);
+    if (!quick_binnable(size))
+    {
+        free(this, ptr);
+        return;
+    }
+
+    kheap_block_header_t **bin = &this->quick_bins[quick_bin(size)];
+    block_links(header)->next = *bin;
+    *bin = header;
+    this->quick_count++;
+    this->quick_bytes += size;
+    if (this->quick_bytes > KHEAP_QUICK_MAX_BYTES)
+    {
+        quick_flush(this);
+    }
+}
+
+// Resize an allocated block in place. Shrinking always succeeds when the
+// block keeps at least the requested size; growing succeeds if the hole on the
+// right (found through the boundary tags) is large enough. If it is not but
+// the block is at the end of the heap, *grow_size is set to how much the heap
+// must grow for the resize to succeed on a retry.
+static bool_t resize(kheap_t *this, void *ptr, uint32_t new_size, uint32_t *grow_size)
+{
+    *grow_size = 0;
+    kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE);
+    ASSERT(block_in_use(header));
+    uint32_t flags = header->size & KHEAP_BLOCK_FLAGS;
+    uint32_t size = block_size(header);
+
+    new_size = alloc_block_size(new_size);
+
+    if (new_size > size)
+    {
+        kheap_block_header_t *right_header = block_next(header);
+        bool_t right_is_hole = !block_in_use(right_header);
+        uint32_t available = size + (right_is_hole ? block_size(right_header) : 0);
+        if (available < new_size)
+        {
+            // Only the last block (or the one before the last hole) can grow past its neighbour.
+            kheap_block_header_t *block_end = right_is_hole ? block_next(right_header) : right_header;
+            if ((uint32_t)block_end == blocks_end(this))
+            {
+                *grow_size = new_size - available + MIN_BLOCK_SIZE;
+            }
+            return false;
+        }
+
+        // Swallow the right hole, the tail is cut off again below.
+        remove_hole(this, right_header);
+        size = available;
+        make_block((uint32_t)header, size, flags);
+    }
+
+    // Cut off what is not needed any more. Going through free() merges the cut
+    // with a hole that may follow it and lets the heap contract.
+    uint32_t remain_size = size - new_size;
+    if (remain_size >= MIN_BLOCK_SIZE)
+    {
+        kheap_block_header_t *tail = make_block((uint32_t)header + new_size, remain_size, IN_USE | PREV_IN_USE);
+        make_block((uint32_t)header, new_size, flags);
+        free(this, (void *)((uint32_t)tail + HEADER_SIZE));
+    }
+    // A grown block may reach into the zero area.
+    zero_area_claim(this, (uint32_t)header + block_size(header) + HOLE_META_SIZE);
+    return true;
+}
+
+// ****************************************************************************
+static bool_t hole_in_free_list(kheap_t *this, kheap_block_header_t *header)
+{
+    uint32_t fl, sl;
+    mapping_insert(block_size(header), &fl, &sl);
+    if (!(this->sl_bitmap[fl] & (1 << sl)))
+    {
+        return 0;
+    }
+    // Walk the list checking the back links on the way, a broken one would
+    // make remove_hole() corrupt a list it never looks at.
+    kheap_block_header_t *prev = NULL;
+    for (kheap_block_header_t *hole = this->free_lists[fl][sl]; hole != NULL; hole = block_links(hole)->next)
+    {
+        ASSERT(block_links(hole)->prev == prev);
+        if (hole == header)
+        {
+            return 1;
+        }
+        prev = hole;
+    }
+    return 0;
+}
+
+// Count the objects cached in magazines, checking that each is an allocated block.
+static uint32_t magazine_cached_objects()
+{
+    uint32_t cached = 0;
+    for (uint32_t i = 0; i < KHEAP_MAG_POOL_SIZE; i++)
+    {
+        kheap_magazine_t *mag = &magazine_pool[i];
+        for (uint32_t r = 0; r < mag->rounds; r++)
+        {
+            kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)mag->objs[r] - HEADER_SIZE);
+            ASSERT(block_in_use(header));
+        }
+        cached += mag->rounds;
+    }
+    for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        kheap_cpu_cache_t *cc = &cpu_caches[cpu];
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            cached += cc->reserve_num[c];
+        }
+        for (void **obj = (void **)cc->deferred; obj != NULL; obj = (void **)*obj)
+        {
+            if (!is_vmalloc_addr(obj))
+            {
+                cached++;
+            }
+        }
+    }
+    return cached;
+}
+
+// Count the blocks waiting in the quick bins of a heap, checking that each is
+// an allocated block in the bin of its size.
+static uint32_t quick_cached_objects(kheap_t *this)
+{
+    uint32_t cached = 0;
+    uint32_t bytes = 0;
+    for (uint32_t b = 0; b < KHEAP_QUICK_BIN_COUNT; b++)
+    {
+        for (kheap_block_header_t *header = this->quick_bins[b]; header != NULL; header = block_links(header)->next)
+        {
+            ASSERT(block_in_use(header));
+            ASSERT(quick_binnable(block_size(header)) && quick_bin(block_size(header)) == b);
+            cached++;
+            bytes += block_size(header);
+        }
+    }
+    ASSERT(cached == this->quick_count && bytes == this->quick_bytes);
+    return cached;
+}
+
+static inline kheap_t *current_arena()
+{
+    return &arenas[cpu_caches[smp_processor_id()].arena];
+}
+
+uint32_t kheap_arena_of(void *ptr)
+{
+    uint32_t addr = (uint32_t)ptr;
+    ASSERT(addr >= KHEAP_START && addr < KHEAP_START + KHEAP_ARENA_COUNT * KHEAP_ARENA_SPAN);
+    return (addr - KHEAP_START) / KHEAP_ARENA_SPAN;
+}
+
+// Returns the number of allocated blocks that are not cached in a magazine or
+// a quick bin, i.e. the allocations that callers still hold.
+uint32_t kheap_validate_print(uint8_t print)
+{
+    uint32_t alloc_num = 0;
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        kheap_t *heap = &arenas[a];
+        if (print)
+        {
+            vga_printf("************************ kheap arena %d ************************\n", a);
+        }
+        uint32_t start = blocks_start(heap);
+        uint32_t hole_num = 0;
+        uint32_t hole_bytes = 0;
+        bool_t prev_used = 1;
+        while (start < blocks_end(heap))
+        {
+            kheap_block_header_t *header = (kheap_block_header_t *)(start);
+            uint32_t size = block_size(header);
+            ASSERT(size >= MIN_BLOCK_SIZE && prev_in_use(header) == prev_used);
+            if (!block_in_use(header))
+            {
+                // Holes are merged, so no two are next to each other.
+                ASSERT(prev_used && ((kheap_block_footer_t *)(start + size - FOOTER_SIZE))->size == size);
+                ASSERT(hole_in_free_list(heap, header));
+                if (print)
+                {
+                    vga_printf("[]--- start:%x end:%x size: %d\n", header, start + size, size - HEADER_SIZE);
+                }
+                hole_num++;
+                hole_bytes += size - HEADER_SIZE;
+            }
+            else
+            {
+                if (print)
+                {
+                    vga_printf("      start:%x end:%x size: %d\n", header, start + size, size - HEADER_SIZE);
+                }
+                alloc_num++;
+            }
+            prev_used = block_in_use(header);
+            start += size;
+            ASSERT(start <= blocks_end(heap));
+        }
+        kheap_block_header_t *epilogue = (kheap_block_header_t *)blocks_end(heap);
+        ASSERT(epilogue->size == (IN_USE | (prev_used ? PREV_IN_USE : 0)));
+        ASSERT(hole_num == heap->hole_count && hole_bytes == heap->hole_bytes);
+        alloc_num -= quick_cached_objects(heap);
+    }
+    if (print)
+    {
+        vga_printf("***************************************************************\n");
+    }
+    uint32_t cached = magazine_cached_objects();
+    ASSERT(cached <= alloc_num);
+    return alloc_num - cached;
+}
+
+void kheap_get_footprint(uint32_t arena, kheap_footprint_t *footprint)
+{
+    ASSERT(arena < KHEAP_ARENA_COUNT);
+    kheap_t *heap = &arenas[arena];
+    yieldlock_lock(&heap->lock);
+    *footprint = heap->footprint;
+    yieldlock_unlock(&heap->lock);
+}
+
+void kheap_footprint_dump()
+{
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        kheap_t *heap = &arenas[a];
+        kheap_footprint_t fp;
+        kheap_get_footprint(a, &fp);
+
+        // Pages that are mapped to a real frame, i.e. not untouched and not the zero page.
+        uint32_t resident = 0;
+        for (uint32_t addr = heap->start_address; addr < heap->end_address; addr += PAGE_SIZE)
+        {
+            uint32_t pa = vmm_get_phys_addr(addr);
+            if (pa != 0 && (pa & 0xFFFFF000) != vmm_zero_page_phys())
+            {
+                resident++;
+            }
+        }
+
+        vga_printf("kheap arena %d footprint: size %dKB, resident %dKB, peak %dKB\n",
+                   a, heap->size / KIB, resident * PAGE_SIZE / KIB, fp.peak_size / KIB);
+        vga_printf("  expands %d (%d pages eager), contracts %d, released %d pages\n",
+                   fp.expands, fp.eager_pages, fp.contracts, fp.released_pages);
+        uint32_t first = fp.history_num > KHEAP_FOOTPRINT_HISTORY ? fp.history_num - KHEAP_FOOTPRINT_HISTORY : 0;
+        vga_printf("  size history:");
+        for (uint32_t n = first; n < fp.history_num; n++)
+        {
+            kheap_footprint_sample_t *sample = &fp.history[n % KHEAP_FOOTPRINT_HISTORY];
+            vga_printf(" %dKB@%d", sample->size / KIB, sample->tick);
+        }
+        vga_printf("\n");
+    }
+    vga_printf("kheap large allocations: %d, %d pages\n", large_map.count, large_pages);
+}
+
+// Size of the largest hole other than tail. The largest holes are all in the
+// highest non-empty free list, so lists are walked from the top down until one
+// holds a hole other than tail; that is normally the first or the second.
+// Caller holds this->lock.
+static uint32_t largest_hole(kheap_t *this, kheap_block_header_t *tail)
+{
+    for (uint32_t fl_map = this->fl_bitmap; fl_map != 0;)
+    {
+        uint32_t fl = bit_fls(fl_map);
+        for (uint32_t sl_map = this->sl_bitmap[fl]; sl_map != 0;)
+        {
+            uint32_t sl = bit_fls(sl_map);
+            uint32_t largest = 0;
+            for (kheap_block_header_t *hole = this->free_lists[fl][sl]; hole != NULL; hole = block_links(hole)->next)
+            {
+                if (hole != tail && block_size(hole) - HEADER_SIZE > largest)
+                {
+                    largest = block_size(hole) - HEADER_SIZE;
+                }
+            }
+            if (largest != 0)
+            {
+                return largest;
+            }
+            sl_map &= ~(1U << sl);
+        }
+        fl_map &= ~(1U << fl);
+    }
+    return 0;
+}
+
+// 1000 * (1 - largest / holes), without 64-bit division.
+static uint32_t frag_permille(uint32_t largest, uint32_t holes)
+{
+    if (holes == 0)
+    {
+        return 0;
+    }
+    while (holes > 0xFFFFFFFF / 1000)
+    {
+        largest >>= 1;
+        holes >>= 1;
+    }
+    return 1000 - largest * 1000 / holes;
+}
+
+void kheap_get_stats(kheap_stats_t *stats)
+{
+    memset(stats, 0, sizeof(kheap_stats_t));
+    stats->headroom = 0xFFFFFFFF;
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        kheap_t *heap = &arenas[a];
+        yieldlock_lock(&heap->lock);
+        uint32_t area = blocks_end(heap) - blocks_start(heap);
+        stats->heap_size += heap->size;
+        stats->in_use += area - heap->hole_bytes - heap->hole_count * HEADER_SIZE;
+        // The hole before the epilogue is where the arena grows and shrinks,
+        // an idle arena is nothing but that hole; it is not fragmentation.
+        kheap_block_header_t *epilogue = (kheap_block_header_t *)blocks_end(heap);
+        kheap_block_header_t *tail = prev_in_use(epilogue) ? NULL : block_prev(epilogue);
+        uint32_t tail_bytes = tail == NULL ? 0 : block_size(tail) - HEADER_SIZE;
+        stats->hole_bytes += heap->hole_bytes - tail_bytes;
+        stats->hole_count += heap->hole_count - (tail == NULL ? 0 : 1);
+        stats->tail_bytes += tail_bytes;
+        stats->quick_bytes += heap->quick_bytes;
+        stats->zero_skipped += heap->zero_skipped;
+        uint32_t largest = largest_hole(heap, tail);
+        if (largest > stats->largest_hole)
+        {
+            stats->largest_hole = largest;
+        }
+        stats->expands += heap->footprint.expands;
+        stats->contracts += heap->footprint.contracts;
+        if (heap->max_address - heap->end_address < stats->headroom)
+        {
+            stats->headroom = heap->max_address - heap->end_address;
+        }
+        yieldlock_unlock(&heap->lock);
+    }
+
+    stats->frag_permille = frag_permille(stats->largest_hole, stats->hole_bytes);
+
+    yieldlock_lock(&large_lock);
+    stats->large_count = large_map.count;
+    stats->large_pages = large_pages;
+    yieldlock_unlock(&large_lock);
+}
+
+void kheap_stats_dump()
+{
+    kheap_stats_t stats;
+    kheap_get_stats(&stats);
+    vga_printf("kheap: size %dKB, in use %dKB, holes %dKB in %d, largest %dKB, fragmentation %d.%d%%, tails %dKB\n",
+               stats.heap_size / KIB, stats.in_use / KIB, stats.hole_bytes / KIB, stats.hole_count,
+               stats.largest_hole / KIB, stats.frag_permille / 10, stats.frag_permille % 10, stats.tail_bytes / KIB);
+    vga_printf("  expands %d, contracts %d, headroom %dKB, large %d (%d pages), quick bins %dKB, zero skipped %dKB\n",
+               stats.expands, stats.contracts, stats.headroom / KIB, stats.large_count, stats.large_pages,
+               stats.quick_bytes / KIB, stats.zero_skipped / KIB);
+}
+
+// Allocate from a heap, growing it as needed. Returns NULL once the arena
+// cannot grow any further. Called without this->lock held. dirty is passed
+// on to alloc().
+static void *kmalloc_impl(kheap_t *this, uint32_t size, uint32_t align, uint32_t *dirty)
+{
+    if (size == 0 || size > this->max_address - this->start_address)
+    {
+        return 0;
+    }
+    if (align < KHEAP_ALIGN)
+    {
+        align = KHEAP_ALIGN;
+    }
+    while (1)
+    {
+        yieldlock_lock(&this->lock);
+        uint32_t seen_end = this->end_address;
+        void *ptr = alloc(this, size, align, dirty);
+        if (ptr == NULL && this->quick_count > 0)
+        {
+            // Merging the deferred frees may leave a hole that fits.
+            quick_flush(this);
+            ptr = alloc(this, size, align, dirty);
+        }
+        yieldlock_unlock(&this->lock);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+        // No free hole fits, we need to expand the heap.
+        if (!kheap_grow(this, alloc_search_size(size, align), seen_end))
+        {
+            return NULL;
+        }
+    }
+}
+
+// Allocate from the current CPU's arena, or from the others once it is full.
+static void *kmalloc_any_arena(uint32_t size, uint32_t align, uint32_t *dirty)
+{
+    uint32_t home = cpu_caches[smp_processor_id()].arena;
+    for (uint32_t i = 0; i < KHEAP_ARENA_COUNT; i++)
+    {
+        void *ptr = kmalloc_impl(&arenas[(home + i) % KHEAP_ARENA_COUNT], size, align, dirty);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+    }
+    return NULL;
+}
+
+// ****************************** per-CPU magazines ******************************
+static inline uint32_t magazine_class(uint32_t size)
+{
+    return size <= (1 << KHEAP_MAG_MIN_SHIFT) ? 0 : bit_fls(size - 1) + 1 - KHEAP_MAG_MIN_SHIFT;
+}
+
+static inline uint32_t magazine_class_size(uint32_t class)
+{
+    return 1 << (KHEAP_MAG_MIN_SHIFT + class);
+}
+
+static void magazine_pool_init()
+{
+    kheap_magazine_t *next_mag = magazine_pool;
+    for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        kheap_cpu_cache_t *cc = &cpu_caches[cpu];
+        cc->arena = cpu % KHEAP_ARENA_COUNT;
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            cc->loaded[c] = next_mag++;
+            cc->previous[c] = next_mag++;
+        }
+    }
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            kheap_depot_t *depot = &arenas[a].depots[c];
+            yieldlock_init(&depot->lock);
+            depot->full = NULL;
+            depot->full_num = 0;
+            depot->empty = NULL;
+            for (uint32_t i = 0; i < KHEAP_DEPOT_MAX_FULL; i++)
+            {
+                kheap_magazine_t *mag = next_mag++;
+                mag->next = depot->empty;
+                depot->empty = mag;
+            }
+        }
+    }
+    ASSERT(next_mag == magazine_pool + KHEAP_MAG_POOL_SIZE);
+}
+
+// Take an object from the CPU's magazines. Caller has interrupts disabled.
+static void *magazine_pop(kheap_cpu_cache_t *cc, uint32_t c)
+{
+    if (cc->loaded[c]->rounds == 0)
+    {
+        if (cc->previous[c]->rounds == 0)
+        {
+            return NULL;
+        }
+        kheap_magazine_t *tmp = cc->loaded[c];
+        cc->loaded[c] = cc->previous[c];
+        cc->previous[c] = tmp;
+    }
+    cc->hits++;
+    kheap_magazine_t *mag = cc->loaded[c];
+    return mag->objs[--mag->rounds];
+}
+
+// Put an object into the CPU's magazines. Caller has interrupts disabled.
+static bool_t magazine_push(kheap_cpu_cache_t *cc, uint32_t c, void *obj)
+{
+    if (cc->loaded[c]->rounds == KHEAP_MAG_ROUNDS)
+    {
+        if (cc->previous[c]->rounds != 0)
+        {
+            return false;
+        }
+        kheap_magazine_t *tmp = cc->loaded[c];
+        cc->loaded[c] = cc->previous[c];
+        cc->previous[c] = tmp;
+    }
+    cc->hits++;
+    kheap_magazine_t *mag = cc->loaded[c];
+    mag->objs[mag->rounds++] = obj;
+    return true;
+}
+
+// Flush all objects of a magazine back to their heap. Caller holds heap->lock.
+static void magazine_flush(kheap_t *heap, kheap_magazine_t *mag)
+{
+    while (mag->rounds > 0)
+    {
+        free(heap, mag->objs[--mag->rounds]);
+    }
+}
+
+// A CPU's magazines only ever hold objects of the arena it is bound to, and
+// an arena's depots only take magazines from CPUs bound to it, so cached
+// objects are always reused in the arena they came from.
+static void *magazine_alloc(uint32_t c)
+{
+    uint32_t eflags = cpu_save_flags_and_cli();
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    void *obj = magazine_pop(cc, c);
+    kheap_t *heap = &arenas[cc->arena];
+    set_eflags(eflags);
+    if (obj != NULL)
+    {
+        return obj;
+    }
+
+    // Both magazines are empty: trade the previous one for a full one from the depot.
+    kheap_depot_t *depot = &heap->depots[c];
+    yieldlock_lock(&depot->lock);
+    eflags = cpu_save_flags_and_cli();
+    cc = &cpu_caches[smp_processor_id()];
+    if (&arenas[cc->arena] == heap && depot->full != NULL && cc->previous[c]->rounds == 0)
+    {
+        kheap_magazine_t *full = depot->full;
+        depot->full = full->next;
+        depot->full_num--;
+
+        cc->previous[c]->next = depot->empty;
+        depot->empty = cc->previous[c];
+        cc->previous[c] = cc->loaded[c];
+        cc->loaded[c] = full;
+        cc->trades++;
+        obj = magazine_pop(cc, c);
+    }
+    else
+    {
+        cc->misses++;
+    }
+    set_eflags(eflags);
+    yieldlock_unlock(&depot->lock);
+    if (obj == NULL)
+    {
+        // The depot is empty as well, allocate from the heap.
+        obj = kmalloc_impl(heap, magazine_class_size(c), 0, NULL);
+    }
+    return obj;
+}
+
+static void magazine_free(uint32_t c, void *obj)
+{
+    kheap_t *owner = &arenas[kheap_arena_of(obj)];
+    uint32_t eflags = cpu_save_flags_and_cli();
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    // Objects of another arena go straight back to it.
+    bool_t home = (&arenas[cc->arena] == owner);
+    bool_t cached = home && magazine_push(cc, c, obj);
+    set_eflags(eflags);
+    if (cached)
+    {
+        return;
+    }
+
+    if (home)
+    {
+        // Both magazines are full: hand the previous one to the depot for an empty one.
+        kheap_depot_t *depot = &owner->depots[c];
+        yieldlock_lock(&depot->lock);
+        eflags = cpu_save_flags_and_cli();
+        cc = &cpu_caches[smp_processor_id()];
+        if (&arenas[cc->arena] == owner && depot->full_num < KHEAP_DEPOT_MAX_FULL &&
+            cc->previous[c]->rounds == KHEAP_MAG_ROUNDS)
+        {
+            ASSERT(depot->empty != NULL);
+            kheap_magazine_t *empty = depot->empty;
+            depot->empty = empty->next;
+
+            cc->previous[c]->next = depot->full;
+            depot->full = cc->previous[c];
+            depot->full_num++;
+            cc->previous[c] = cc->loaded[c];
+            cc->loaded[c] = empty;
+            cc->trades++;
+            cached = magazine_push(cc, c, obj);
+        }
+        else
+        {
+            cc->misses++;
+        }
+        set_eflags(eflags);
+        yieldlock_unlock(&depot->lock);
+    }
+    if (!cached)
+    {
+        // The depot has enough full magazines, give the object back to the heap.
+        yieldlock_lock(&owner->lock);
+        free(owner, obj);
+        yieldlock_unlock(&owner->lock);
+    }
+}
 
-static uint32_t align_to_page(uint32_t num)
+// Flush the magazines of every CPU bound to arena a, and the full magazines of
+// its depot for class c. Caller holds the depot lock and the arena lock.
+static void magazine_drain_class(uint32_t a, uint32_t c)
 {
-    if ((num & 0xFFF) != 0)
+    kheap_t *heap = &arenas[a];
+    kheap_depot_t *depot = &heap->depots[c];
+    // A CPU changes its own magazines with only interrupts disabled, so no
+    // other CPU may touch them: only the current CPU's are flushed here.
+    uint32_t eflags = cpu_save_flags_and_cli();
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    if (cc->arena == a)
     {
-        return (num & 0xFFFFF000) + PAGE_SIZE;
+        magazine_flush(heap, cc->loaded[c]);
+        magazine_flush(heap, cc->previous[c]);
     }
-    return num;
+    set_eflags(eflags);
+    while (depot->full != NULL)
+    {
+        kheap_magazine_t *mag = depot->full;
+        depot->full = mag->next;
+        magazine_flush(heap, mag);
+        mag->next = depot->empty;
+        depot->empty = mag;
+    }
+    depot->full_num = 0;
 }
 
-static uint32_t kheap_expand(kheap_t *this, uint32_t expand_size)
+void kheap_drain_magazines()
 {
-    vga_printf("kheap expand size = %d, end_address = %p, max_address = %p \n", expand_size, this->end_address, this->max_address);
-    expand_size = align_to_page(expand_size);
-    if (expand_size <= 0)
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
     {
-        return 0;
+        kheap_t *heap = &arenas[a];
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            yieldlock_lock(&heap->depots[c].lock);
+            yieldlock_lock(&heap->lock);
+            magazine_drain_class(a, c);
+            yieldlock_unlock(&heap->lock);
+            yieldlock_unlock(&heap->depots[c].lock);
+        }
+        yieldlock_lock(&heap->lock);
+        quick_flush(heap);
+        yieldlock_unlock(&heap->lock);
     }
-
-    uint32_t new_end = this->end_address + expand_size;
-    ASSERT(new_end <= this->max_address);
-    this->end_address = new_end;
-    this->size = this->size + expand_size;
-    return expand_size;
 }
 
-__attribute__((unused)) static uint32_t kheap_contract(kheap_t *this, uint32_t contract_size)
+void kheap_reclaim(uint32_t idle_ticks)
 {
-    contract_size = align_to_page(contract_size);
-    if (contract_size <= 0)
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
     {
-        return 0;
+        kheap_t *heap = &arenas[a];
+        yieldlock_lock(&heap->lock);
+        kheap_block_header_t *epilogue = (kheap_block_header_t *)blocks_end(heap);
+        if (!prev_in_use(epilogue))
+        {
+            kheap_trim(heap, block_prev(epilogue), idle_ticks);
+        }
+        yieldlock_unlock(&heap->lock);
     }
+}
+
+void kheap_bind_cpu(uint32_t cpu, uint32_t arena)
+{
+    // The magazines are flushed below, which only their own CPU may do.
+    ASSERT(cpu == smp_processor_id() && arena < KHEAP_ARENA_COUNT);
+    kheap_cpu_cache_t *cc = &cpu_caches[cpu];
+    kheap_t *old = &arenas[cc->arena];
 
-    uint32_t new_size = this->size - contract_size;
-    if (new_size < KHEAP_MIN_SIZE)
+    // The CPU's magazines hold objects of its old arena: give them back first.
+    yieldlock_lock(&old->lock);
+    uint32_t eflags = cpu_save_flags_and_cli();
+    for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
     {
-        new_size = KHEAP_MIN_SIZE;
+        magazine_flush(old, cc->loaded[c]);
+        magazine_flush(old, cc->previous[c]);
     }
-    this->size = new_size;
-
-    this->end_address = this->start_address + new_size;
-    return new_size;
+    cc->arena = arena;
+    set_eflags(eflags);
+    yieldlock_unlock(&old->lock);
 }
 
-static kheap_block_header_t *make_block(uint32_t start, uint32_t size, uint8_t is_hole)
+void kheap_magazine_dump()
 {
-    ASSERT(size > 0);
-    uint32_t end = start + size + BLOCK_META_SIZE;
+    vga_printf("kheap magazines:\n");
+    for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        kheap_cpu_cache_t *cc = &cpu_caches[cpu];
+        if (cc->hits + cc->trades + cc->misses == 0)
+        {
+            continue;
+        }
+        vga_printf("  cpu%d (arena %d): hits %d, depot trades %d, misses %d\n",
+                   cpu, cc->arena, cc->hits, cc->trades, cc->misses);
+        vga_printf("    atomic %d (reserve %d), exhausted %d, deferred frees %d\n",
+                   cc->atomic_allocs, cc->reserve_allocs, cc->exhausted, cc->deferred_frees);
+    }
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        vga_printf("  arena %d depot full:", a);
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            vga_printf(" %d:%d", magazine_class_size(c), arenas[a].depots[c].full_num);
+        }
+        vga_printf("\n");
+        vga_printf("  arena %d quick bins: %d blocks (%dKB), hits %d, flushes %d\n", a, arenas[a].quick_count,
+                   arenas[a].quick_bytes / KIB, arenas[a].quick_hits, arenas[a].quick_flushes);
+    }
+}
 
-    // vga_printf("start = %x\n", start);
-    kheap_block_header_t *block_header = (kheap_block_header_t *)start;
-    block_header->magic = KHEAP_MAGIC;
-    block_header->size = size;
-    block_header->is_hole = is_hole;
+void kheap_lock_dump()
+{
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        kheap_t *heap = &arenas[a];
+        vga_printf("kheap arena %d lock contention: heap %d, expand %d, depots",
+                   a, heap->lock.contended, heap->expand_lock.contended);
+        for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+        {
+            vga_printf(" %d:%d", magazine_class_size(c), heap->depots[c].lock.contended);
+        }
+        vga_printf("\n");
+    }
+}
 
-    // vga_printf("end = %x\n", end);
-    kheap_block_footer_t *block_footer = (kheap_block_footer_t *)(end - FOOTER_SIZE);
-    block_footer->magic = KHEAP_MAGIC;
-    block_footer->header = block_header;
+// ****************************** large allocations ******************************
+// Map whole pages for a large request. Returns NULL if the table or the
+// vmalloc window is full; the caller then uses the heap.
+static void *large_alloc(uint32_t size, uint32_t align)
+{
+    uint32_t pages = align_to_page(size) / PAGE_SIZE;
+    if (ptr_table_full(&large_map))
+    {
+        return NULL;
+    }
+    void *ptr = vmalloc_pages(pages, align > PAGE_SIZE ? align / PAGE_SIZE : 1);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
 
-    return block_header;
+    yieldlock_lock(&large_lock);
+    kheap_large_t *large = ptr_table_insert(&large_map, (uint32_t)ptr);
+    if (large == NULL)
+    {
+        yieldlock_unlock(&large_lock);
+        vfree_pages(ptr, pages);
+        return NULL;
+    }
+    large->pages = pages;
+    large_pages += pages;
+    yieldlock_unlock(&large_lock);
+    return ptr;
 }
 
-static int32_t kheap_block_comparator(type_t x, type_t y)
+// Entry of a large allocation. Caller holds large_lock.
+static kheap_large_t *large_find(void *ptr)
 {
-    uint32_t size1 = ((kheap_block_header_t *)x)->size;
-    uint32_t size2 = ((kheap_block_header_t *)y)->size;
-    return size1 < size2 ? -1 : (size1 == size2 ? 0 : 1);
+    kheap_large_t *large = ptr_table_find(&large_map, (uint32_t)ptr);
+    // Every address given to kfree() must have been handed out by large_alloc().
+    ASSERT(large != NULL);
+    return large;
 }
 
-kheap_t create_kheap(uint32_t start, uint32_t end, uint32_t max, uint8_t supervisor, uint8_t readonly)
+static uint32_t large_size(void *ptr)
 {
-    ASSERT((start & 0xFFF) == 0);
-    ASSERT((end & 0xFFF) == 0);
-
-    kheap_t kheap;
-
-    // Initialize the index array.
-    kheap.index = ordered_array_create((type_t *)start, KHEAP_INDEX_NUM, &kheap_block_comparator);
+    yieldlock_lock(&large_lock);
+    uint32_t pages = large_find(ptr)->pages;
+    yieldlock_unlock(&large_lock);
+    return pages * PAGE_SIZE;
+}
 
-    // Shift the start address forward to resemble where we can start putting data.
-    start += ((sizeof(type_t) * KHEAP_INDEX_NUM));
+static void large_free(void *ptr)
+{
+    yieldlock_lock(&large_lock);
+    kheap_large_t *large = large_find(ptr);
+    uint32_t pages = large->pages;
+    ptr_table_remove(&large_map, large);
+    large_pages -= pages;
+    yieldlock_unlock(&large_lock);
+    vfree_pages(ptr, pages);
+}
 
-    // Write the start, end and max addresses into the heap structure.
-    kheap.start_address = start;
-    kheap.end_address = end;
-    kheap.size = end - start;
-    kheap.max_address = max;
-    kheap.supervisor = supervisor;
-    kheap.readonly = readonly;
+// ****************************** atomic allocation ******************************
+// Objects of a magazine class size (plus the slack alloc() may have absorbed
+// into them) can be cached for reuse instead of being freed.
+static bool_t magazine_cacheable(void *ptr, uint32_t *class)
+{
+    kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE);
+    ASSERT(block_in_use(header));
+    uint32_t size = block_size(header);
+    if (size < alloc_block_size(magazine_class_size(0)) ||
+        size >= alloc_block_size(KHEAP_MAG_MAX_SIZE) + MIN_BLOCK_SIZE)
+    {
+        return false;
+    }
+    // Class sizes are multiples of KHEAP_ALIGN, so their blocks are KHEAP_ALIGN
+    // bytes longer; take the largest class whose block fits.
+    uint32_t fit = size - KHEAP_ALIGN;
+    uint32_t c = (fit >= KHEAP_MAG_MAX_SIZE) ? KHEAP_MAG_CLASS_COUNT - 1 : magazine_class(fit + 1) - 1;
+    *class = c;
+    return size - alloc_block_size(magazine_class_size(c)) < MIN_BLOCK_SIZE;
+}
 
-    // Start off with one large hole in the index.
-    make_block(start, end - start - BLOCK_META_SIZE, IS_HOLE);
-    ordered_array_insert(&kheap.index, (type_t)start);
+static void kfree_impl(void *ptr)
+{
+    if (is_vmalloc_addr(ptr))
+    {
+        large_free(ptr);
+        return;
+    }
+    uint32_t c;
+    if (magazine_cacheable(ptr, &c))
+    {
+        magazine_free(c, ptr);
+        return;
+    }
 
-    return kheap;
+    // The block may belong to any arena, not just the current CPU's.
+    kheap_t *owner = &arenas[kheap_arena_of(ptr)];
+    yieldlock_lock(&owner->lock);
+    quick_free(owner, ptr);
+    yieldlock_unlock(&owner->lock);
 }
 
-// Find the smallest hole that fits requested size.
-// Note if page_align is required,
-static int32_t find_hole(kheap_t *this, uint32_t size, uint8_t page_align, uint32_t *alloc_pos)
+// Process context only. Only this function adds to a CPU's reserve and takes
+// its deferred list; interrupt handlers only take from the reserve and add to
+// the list, so both are updated with interrupts disabled.
+static void reserve_refill(uint32_t cpu)
 {
-    for (int i = 0; i < this->index.size; i++)
+    kheap_cpu_cache_t *cc = &cpu_caches[cpu];
+    uint32_t eflags = cpu_save_flags_and_cli();
+    void **deferred = (void **)cc->deferred;
+    cc->deferred = NULL;
+    cc->refill_pending = 0;
+    set_eflags(eflags);
+    while (deferred != NULL)
     {
-        kheap_block_header_t *header = (kheap_block_header_t *)ordered_array_get(&this->index, i);
-        uint32_t start = (uint32_t)header + HEADER_SIZE;
-        if (page_align)
+        void **next = (void **)*deferred;
+        kfree_impl(deferred);
+        deferred = next;
+    }
+
+    kheap_t *heap = &arenas[cc->arena];
+    for (uint32_t c = 0; c < KHEAP_MAG_CLASS_COUNT; c++)
+    {
+        while (cc->reserve_num[c] < KHEAP_RESERVE_ROUNDS)
         {
-            // Align the starting point.
-            // |..................|..................|..................|  page align
-            //      |h| data  |f|h| data |f|
-            uint32_t end = start + header->size;
-            uint32_t next_page_align = align_to_page(start);
-            while (next_page_align + size <= end)
+            // Take fresh blocks from the heap rather than from the magazines,
+            // which are the first line for atomic allocations anyway.
+            void *obj = kmalloc_impl(heap, magazine_class_size(c), 0, NULL);
+            if (obj == NULL)
             {
-                if (next_page_align - start > BLOCK_META_SIZE)
-                {
-                    *alloc_pos = next_page_align;
-                    return i;
-                }
-                next_page_align += PAGE_SIZE;
+                break;
             }
-        }
-        else if (header->size >= size)
-        {
-            *alloc_pos = start;
-            return i;
+            eflags = cpu_save_flags_and_cli();
+            cc->reserve[c][cc->reserve_num[c]++] = obj;
+            set_eflags(eflags);
         }
     }
+}
 
-    return -1;
+static inline void reserve_check()
+{
+    uint32_t cpu = smp_processor_id();
+    if (cpu_caches[cpu].refill_pending)
+    {
+        reserve_refill(cpu);
+    }
 }
 
-void *alloc(kheap_t *this, uint32_t size, uint8_t page_align)
+void kheap_refill_reserves()
 {
-    ASSERT(size > 0);
+    reserve_refill(smp_processor_id());
+}
 
-    uint32_t alloc_pos;
-    int32_t iterator = find_hole(this, size, page_align, &alloc_pos);
-    if (iterator < 0)
+// The public kmalloc family below records each allocation and free with the
+// profiler; the do_ functions are what they share and do not.
+void *kmalloc_atomic(uint32_t size)
+{
+    if (size == 0 || size > KHEAP_MAG_MAX_SIZE)
     {
-        // No free hole fits, we need to expand the heap.
-        uint32_t old_end_address = this->end_address;
-        uint32_t extended_size = kheap_expand(this, size + BLOCK_META_SIZE);
-
-        kheap_block_footer_t *last_footer = (kheap_block_footer_t *)(old_end_address - FOOTER_SIZE);
-        kheap_block_header_t *last_header = last_footer->header;
-        if (last_header->is_hole)
-        {
-            // Extend the last hole. Note after extension, it needs to be taken out and re-inserted
-            // into the index ordered array since its size has been changed.
-            make_block((uint32_t)last_header, last_header->size + extended_size, IS_HOLE);
-            int32_t remove = ordered_array_remove_element(&this->index, last_header);
-            ASSERT(remove);
-            ordered_array_insert(&this->index, last_header);
-        }
-        else
+        return NULL;
+    }
+    uint32_t c = magazine_class(size);
+    uint32_t eflags = cpu_save_flags_and_cli();
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    void *obj = magazine_pop(cc, c);
+    if (obj == NULL && cc->reserve_num[c] > 0)
+    {
+        obj = cc->reserve[c][--cc->reserve_num[c]];
+        cc->reserve_allocs++;
+        if (cc->reserve_num[c] <= KHEAP_RESERVE_LOW)
         {
-            // Append a new hole to the end.
-            kheap_block_header_t *new_last_header =
-                make_block(old_end_address, extended_size - BLOCK_META_SIZE, IS_HOLE);
-            ordered_array_insert(&this->index, (type_t)new_last_header);
+            cc->refill_pending = 1;
         }
+    }
+    if (obj != NULL)
+    {
+        cc->atomic_allocs++;
+    }
+    else
+    {
+        cc->exhausted++;
+        cc->refill_pending = 1;
+    }
+    set_eflags(eflags);
+    kheap_profile_alloc(obj, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(obj, size);
+    return obj;
+}
 
-        // Now try alloc again.
-        return alloc(this, size, page_align);
+void kfree_atomic(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
     }
+    kheap_profile_free(ptr);
+    kheap_trace_on_free(ptr);
+    uint32_t c;
+    bool_t cacheable = !is_vmalloc_addr(ptr) && magazine_cacheable(ptr, &c);
+    uint32_t eflags = cpu_save_flags_and_cli();
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    if (!cacheable || kheap_arena_of(ptr) != cc->arena || !magazine_push(cc, c, ptr))
+    {
+        // Every block has room for a pointer in its payload.
+        *(void **)ptr = cc->deferred;
+        cc->deferred = ptr;
+        cc->deferred_frees++;
+        cc->refill_pending = 1;
+    }
+    set_eflags(eflags);
+}
 
-    kheap_block_header_t *header = (kheap_block_header_t *)ordered_array_get(&this->index, iterator);
-    ASSERT(header->magic == KHEAP_MAGIC);
-    uint32_t block_size = header->size;
+void init_kheap()
+{
+    // The heap range is anonymous memory: untouched pages read as zero through
+    // the shared zero page and only get a real frame on their first write.
+    vmm_region_register("kheap", KHEAP_START, KHEAP_MAX, VMM_REGION_ANON | VMM_REGION_TRACK_IDLE | VMM_REGION_THP);
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        uint32_t start = KHEAP_START + a * KHEAP_ARENA_SPAN;
+        arenas[a] = create_kheap(start, start + KHEAP_MIN_SIZE, start + KHEAP_ARENA_SPAN, 0, 0);
+    }
+    magazine_pool_init();
+    yieldlock_init(&large_lock);
+    for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        reserve_refill(cpu);
+    }
+}
 
-    ordered_array_remove(&this->index, iterator);
-    // If page-align is required, there may be space in the front that can make a new hole.
-    if (page_align)
+// If dirty is not NULL, it is set to the number of bytes at the start of the
+// allocation that may not be zero. Magazine objects are reused as they are and
+// vmalloc maps frames straight from the PMM, so only the heap knows better.
+static void *do_kmalloc(uint32_t size, uint32_t *dirty)
+{
+    reserve_check();
+    if (dirty != NULL)
+    {
+        *dirty = size;
+    }
+    if (size > 0 && size <= KHEAP_MAG_MAX_SIZE)
     {
-        kheap_block_header_t *alloc_block_header = (kheap_block_header_t *)(alloc_pos - HEADER_SIZE);
-        if (alloc_block_header > header)
+        void *ptr = magazine_alloc(magazine_class(size));
+        if (ptr != NULL)
         {
-            uint32_t cut_block_size = (uint32_t)alloc_block_header - (uint32_t)header;
-            ASSERT(cut_block_size > BLOCK_META_SIZE);
-            make_block((uint32_t)header, cut_block_size - BLOCK_META_SIZE, IS_HOLE);
-            ordered_array_insert(&this->index, (type_t)header);
-            block_size -= cut_block_size;
-            header = alloc_block_header;
+            return ptr;
         }
+        // The CPU's arena is full.
+        return kmalloc_any_arena(magazine_class_size(magazine_class(size)), 0, NULL);
     }
-
-    // Use this block.
-    ASSERT(block_size >= size);
-    uint32_t remain_size = block_size - size;
-    if (remain_size <= BLOCK_META_SIZE)
+    if (size > KHEAP_LARGE_THRESHOLD)
     {
-        size = block_size;
-        remain_size = 0;
+        void *ptr = large_alloc(size, PAGE_SIZE);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
     }
-    kheap_block_header_t *selected_hole_header = make_block((uint32_t)header, size, NOT_HOLE);
-    (void)selected_hole_header;
 
-    // If there is remaining size after, cut a new hole.
-    if (remain_size > 0)
+    return kmalloc_any_arena(size, 0, dirty);
+}
+
+static void *do_kzalloc(uint32_t size)
+{
+    uint32_t dirty;
+    void *ptr = do_kmalloc(size, &dirty);
+    if (ptr != NULL && dirty > 0)
     {
-        ASSERT(remain_size > BLOCK_META_SIZE);
-        kheap_block_header_t *remain_hole_header = make_block(
-            (uint32_t)header + BLOCK_META_SIZE + size, remain_size - BLOCK_META_SIZE, IS_HOLE);
-        ordered_array_insert(&this->index, (type_t)remain_hole_header);
+        memzero(ptr, dirty);
     }
+    return ptr;
+}
 
-    // done
-    return (void *)(alloc_pos);
+static void *do_kmalloc_align(uint32_t size, uint32_t align)
+{
+    ASSERT(align != 0 && (align & (align - 1)) == 0);
+    if (align <= KHEAP_ALIGN)
+    {
+        return do_kmalloc(size, NULL);
+    }
+    if (size > KHEAP_LARGE_THRESHOLD)
+    {
+        void *ptr = large_alloc(size, align);
+        if (ptr != NULL)
+        {
+            return ptr;
+        }
+    }
+    return kmalloc_any_arena(size, align, NULL);
 }
 
-void free(kheap_t *this, void *ptr)
+static void do_kfree(void *ptr)
 {
     if (ptr == NULL)
     {
         return;
     }
+    reserve_check();
+    kfree_impl(ptr);
+}
 
-    kheap_block_header_t *header = (kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE);
-    kheap_block_footer_t *footer = (kheap_block_footer_t *)((uint32_t)ptr + header->size);
-    ASSERT(header->magic == KHEAP_MAGIC);
-    ASSERT(footer->magic == KHEAP_MAGIC);
-
-    // Make us a hole.
-    header->is_hole = 1;
-    kheap_block_header_t *new_hole = header;
-
-    // Merge with right.
-    kheap_block_header_t *right_header = (kheap_block_header_t *)((uint32_t)footer + FOOTER_SIZE);
-    if (right_header->magic == KHEAP_MAGIC && right_header->is_hole)
+static void *do_krealloc(void *ptr, uint32_t new_size)
+{
+    if (ptr == NULL)
     {
-        make_block((uint32_t)header, header->size + right_header->size + BLOCK_META_SIZE, IS_HOLE);
-        int32_t remove = ordered_array_remove_element(&this->index, right_header);
-        ASSERT(remove);
+        return do_kmalloc(new_size, NULL);
     }
-
-    // Merge with left.
-    kheap_block_footer_t *left_footer = (kheap_block_footer_t *)((uint32_t)header - FOOTER_SIZE);
-    if (left_footer->magic == KHEAP_MAGIC && left_footer->header->is_hole == 1)
+    if (new_size == 0)
     {
-        kheap_block_header_t *left_header = left_footer->header;
-        make_block((uint32_t)left_header, left_header->size + header->size + BLOCK_META_SIZE, IS_HOLE);
-        int32_t remove = ordered_array_remove_element(&this->index, left_header);
-        ASSERT(remove);
-        new_hole = left_header;
+        do_kfree(ptr);
+        return NULL;
     }
 
-    ordered_array_insert(&this->index, (type_t)new_hole);
-}
-
-// ****************************************************************************
-uint32_t kheap_validate_print(uint8_t print)
-{
-    if (print)
+    uint32_t old_size;
+    if (is_vmalloc_addr(ptr))
     {
-        vga_printf("*************************** kheap *****************************\n");
+        old_size = large_size(ptr);
+        if (new_size > KHEAP_LARGE_THRESHOLD && align_to_page(new_size) == old_size)
+        {
+            return ptr;
+        }
     }
-    uint32_t start = kheap.start_address;
-    uint32_t hole_num = 0;
-    uint32_t alloc_num = 0;
-    while (start < kheap.end_address)
+    else
     {
-        kheap_block_header_t *header = (kheap_block_header_t *)(start);
-        ASSERT(header->magic == KHEAP_MAGIC);
-        if (header->is_hole)
+        kheap_t *owner = &arenas[kheap_arena_of(ptr)];
+        while (new_size <= KHEAP_LARGE_THRESHOLD)
         {
-            ASSERT(ordered_array_find_element(&kheap.index, (type_t)header) < kheap.index.size);
-            if (print)
+            uint32_t grow_size;
+            yieldlock_lock(&owner->lock);
+            uint32_t seen_end = owner->end_address;
+            bool_t in_place = resize(owner, ptr, new_size, &grow_size);
+            yieldlock_unlock(&owner->lock);
+            if (in_place)
             {
-                vga_printf("[]--- start:%x end:%x size: %d\n",
-                               header, (uint32_t)header + header->size + BLOCK_META_SIZE, header->size);
+                return ptr;
             }
-            hole_num++;
-        }
-        else
-        {
-            if (print)
+            if (grow_size == 0)
             {
-                vga_printf("      start:%x end:%x size: %d\n",
-                               header, (uint32_t)header + header->size + BLOCK_META_SIZE, header->size);
+                break;
+            }
+            // The block is at the end of the heap: grow the heap under it and retry.
+            if (!kheap_grow(owner, grow_size, seen_end))
+            {
+                break;
             }
-            alloc_num++;
         }
-        start += (header->size + BLOCK_META_SIZE);
-        ASSERT(start <= kheap.end_address);
+        old_size = block_size((kheap_block_header_t *)((uint32_t)ptr - HEADER_SIZE)) - HEADER_SIZE;
     }
-    if (print)
+
+    // The neighbour is in use, or the block moves to or from the large pages: move the data.
+    void *new_ptr = do_kmalloc(new_size, NULL);
+    if (new_ptr == NULL)
     {
-        vga_printf("***************************************************************\n");
+        return NULL;
     }
-    ASSERT(hole_num == kheap.index.size);
-    return alloc_num;
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    do_kfree(ptr);
+    return new_ptr;
 }
 
-void init_kheap()
+void *kmalloc(uint32_t size)
 {
-    yieldlock_init(&kheap_lock);
-    kheap = create_kheap(KHEAP_START, KHEAP_START + KHEAP_MIN_SIZE, KHEAP_MAX, 0, 0);
+    void *ptr = do_kmalloc(size, NULL);
+    kheap_profile_alloc(ptr, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, size);
+    return ptr;
 }
 
-static void *kmalloc_impl(uint32_t size, uint8_t align)
+void *kzalloc(uint32_t size)
 {
-    if (size == 0)
-    {
-        return 0;
-    }
-    void *ptr = alloc(&kheap, size, (uint8_t)align);
-    if (ptr == NULL)
+    void *ptr = do_kzalloc(size);
+    kheap_profile_alloc(ptr, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, size);
+    return ptr;
+}
+
+void *kcalloc(uint32_t num, uint32_t size)
+{
+    if (size != 0 && num > 0xFFFFFFFF / size)
     {
-        PANIC();
+        return NULL;
     }
+    void *ptr = do_kzalloc(num * size);
+    kheap_profile_alloc(ptr, num * size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, num * size);
     return ptr;
 }
 
-void *kmalloc(uint32_t size)
+void *kmalloc_aligned(uint32_t size)
 {
-    yieldlock_lock(&kheap_lock);
-    void *ptr = kmalloc_impl(size, 0);
-    yieldlock_unlock(&kheap_lock);
+    void *ptr = do_kmalloc_align(size, PAGE_SIZE);
+    kheap_profile_alloc(ptr, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, size);
     return ptr;
 }
 
-void *kmalloc_aligned(uint32_t size)
+void *kmalloc_align(uint32_t size, uint32_t align)
 {
-    yieldlock_lock(&kheap_lock);
-    void *ptr = kmalloc_impl(size, 1);
-    yieldlock_unlock(&kheap_lock);
+    void *ptr = do_kmalloc_align(size, align);
+    kheap_profile_alloc(ptr, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, size);
     return ptr;
 }
 
-void kfree(void *ptr)
+void *kmalloc_arena(uint32_t arena, uint32_t size)
 {
-    if (ptr == NULL)
+    ASSERT(arena < KHEAP_ARENA_COUNT);
+    void *ptr = kmalloc_impl(&arenas[arena], size, 0, NULL);
+    kheap_profile_alloc(ptr, size, KHEAP_CALLER);
+    kheap_trace_on_alloc(ptr, size);
+    return ptr;
+}
+
+void *krealloc(void *ptr, uint32_t new_size)
+{
+    void *new_ptr = do_krealloc(ptr, new_size);
+    // A failed krealloc leaves ptr live.
+    if (new_ptr != NULL || new_size == 0)
     {
-        return;
+        kheap_profile_free(ptr);
     }
-    yieldlock_lock(&kheap_lock);
-    free(&kheap, ptr);
-    yieldlock_unlock(&kheap_lock);
+    kheap_profile_alloc(new_ptr, new_size, KHEAP_CALLER);
+    kheap_trace_on_realloc(ptr, new_ptr, new_size);
+    return new_ptr;
+}
+
+void kfree(void *ptr)
+{
+    kheap_profile_free(ptr);
+    kheap_trace_on_free(ptr);
+    do_kfree(ptr);
 }
 
 // ******************************** unit tests **********************************
@@ -464,4 +2049,261 @@ void kheap_killer()
 
     vga_printf("OK\n");
     ASSERT(kheap_validate_print(1) == 0);
+}
+
+// The current CPU's arena and another one.
+static kheap_t *test_arenas(uint32_t *home, uint32_t *other)
+{
+    *home = cpu_caches[smp_processor_id()].arena;
+    *other = (*home + 1) % KHEAP_ARENA_COUNT;
+    return &arenas[*home];
+}
+
+void kheap_realloc_test()
+{
+    vga_printf("kheap realloc test ... ");
+    // Objects cached in the magazines would make the layout below unpredictable.
+    kheap_drain_magazines();
+
+    // krealloc grows into the hole on its right and keeps the data.
+    uint8_t *buf = (uint8_t *)kmalloc(64);
+    buf[0] = 0x5A;
+    buf[63] = 0xA5;
+    uint8_t *grown = (uint8_t *)krealloc(buf, 4000);
+    ASSERT(grown == buf && grown[0] == 0x5A && grown[63] == 0xA5);
+    ASSERT(krealloc(grown, 32) == grown);
+    // With a block right behind it, growing has to move.
+    uint8_t *fence = (uint8_t *)kmalloc(16);
+    grown = (uint8_t *)krealloc(grown, 8000);
+    ASSERT(grown != buf && grown[0] == 0x5A);
+    ASSERT(kheap_validate_print(0) == 2);
+    kfree(fence);
+    kfree(grown);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_quick_test()
+{
+    vga_printf("kheap quick bin test ... ");
+    // A freed block in the quick bin range is not merged but handed out again
+    // to the next request of its size. Overflowing the bins merges them all.
+    kheap_drain_magazines();
+    kheap_t *heap = current_arena();
+    uint32_t holes = heap->hole_count;
+    uint32_t flushes = heap->quick_flushes;
+    uint32_t quick_num = KHEAP_QUICK_MAX_BYTES / alloc_block_size(1000) + 1;
+    void *quick[quick_num];
+    quick[0] = kmalloc(1000);
+    kfree(quick[0]);
+    ASSERT(heap->quick_count == 1 && heap->hole_count == holes);
+    ASSERT(kmalloc(1000) == quick[0] && heap->quick_count == 0);
+    for (uint32_t i = 1; i < quick_num; i++)
+    {
+        quick[i] = kmalloc(1000);
+    }
+    for (uint32_t i = 0; i < quick_num; i++)
+    {
+        kfree(quick[i]);
+    }
+    ASSERT(heap->quick_flushes == flushes + 1 && heap->quick_count == 0 && heap->hole_count == holes);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_align_test()
+{
+    vga_printf("kheap align test ... ");
+    // An allocated block is its header and payload and nothing more.
+    void *tight = kmalloc_arena(cpu_caches[smp_processor_id()].arena, 64 - HEADER_SIZE);
+    ASSERT(block_size((kheap_block_header_t *)((uint32_t)tight - HEADER_SIZE)) == 64);
+    kfree(tight);
+    ASSERT(kheap_validate_print(0) == 0);
+
+    // Every allocation is KHEAP_ALIGN aligned, and kmalloc_align honours any
+    // power of two.
+    void *aligned[16];
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        uint32_t align = 1 << (i % 14);
+        aligned[i] = (i % 2) ? kmalloc_align(rand_range(1, 3000), align) : kmalloc(rand_range(1, 3000));
+        ASSERT(((uint32_t)aligned[i] & (KHEAP_ALIGN - 1)) == 0);
+        ASSERT((i % 2) == 0 || ((uint32_t)aligned[i] & (align - 1)) == 0);
+    }
+    ASSERT(kheap_validate_print(0) == 16);
+    for (uint32_t i = 0; i < 16; i++)
+    {
+        kfree(aligned[i]);
+    }
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_contract_test()
+{
+    vga_printf("kheap contract test ... ");
+    // A burst past the end of the heap is kept while the heap is busy, so the
+    // next one reuses it, and given back once the heap has not grown for a while.
+    uint32_t home, other;
+    kheap_t *heap = test_arenas(&home, &other);
+    uint32_t size_before = heap->size;
+    void *burst = kmalloc_arena(home, KHEAP_MIN_SIZE * 2);
+    uint32_t size_burst = heap->size;
+    ASSERT(size_burst > size_before);
+    kfree(burst);
+    ASSERT(heap->size == size_burst);
+    burst = kmalloc_arena(home, KHEAP_MIN_SIZE * 2);
+    ASSERT(heap->size == size_burst);
+    kfree(burst);
+    kheap_reclaim(0);
+    ASSERT(heap->size <= size_before);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_zero_test()
+{
+    vga_printf("kheap zero test ... ");
+    // kzalloc leaves the pages the heap grows into alone and clears what was
+    // handed out before.
+    kheap_drain_magazines();
+    uint32_t dirty;
+    uint8_t *fresh = (uint8_t *)kmalloc_impl(current_arena(), KHEAP_MIN_SIZE * 2, 0, &dirty);
+    ASSERT(dirty < KHEAP_MIN_SIZE);
+    for (uint32_t i = dirty; i < KHEAP_MIN_SIZE * 2; i += 1000)
+    {
+        ASSERT(fresh[i] == 0);
+    }
+    kfree(fresh);
+    uint8_t *reused = (uint8_t *)kmalloc(3000);
+    memset(reused, 0xAB, 3000);
+    kfree(reused);
+    uint8_t *zeroed = (uint8_t *)kzalloc(3000);
+    ASSERT(zeroed == reused);
+    for (uint32_t i = 0; i < 3000; i++)
+    {
+        ASSERT(zeroed[i] == 0);
+    }
+    kfree(zeroed);
+    uint32_t *array = (uint32_t *)kcalloc(100, sizeof(uint32_t));
+    ASSERT(array != NULL && array[0] == 0 && array[99] == 0);
+    kfree(array);
+    ASSERT(kcalloc(0x10000, 0x10000) == NULL);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_arena_test()
+{
+    vga_printf("kheap arena test ... ");
+    // Allocations bound to another arena come from its range and go back to
+    // it when freed from here, even in a magazine size class.
+    uint32_t home, other;
+    test_arenas(&home, &other);
+    void *remote = kmalloc_arena(other, 100);
+    void *remote_small = kmalloc_arena(other, 32);
+    ASSERT(kheap_arena_of(remote) == other && kheap_arena_of(remote_small) == other);
+    // An arena that cannot grow any further fails the request instead of panicking.
+    ASSERT(kmalloc_arena(other, KHEAP_ARENA_SPAN) == NULL);
+    ASSERT(kheap_validate_print(0) == 2);
+    kfree(remote);
+    kfree(remote_small);
+    ASSERT(kheap_validate_print(0) == 0);
+
+    // Rebinding the CPU moves its small allocations to the new arena.
+    uint32_t cpu = smp_processor_id();
+    kheap_bind_cpu(cpu, other);
+    void *moved = kmalloc(32);
+    ASSERT(kheap_arena_of(moved) == other);
+    kheap_bind_cpu(cpu, home);
+    kfree(moved);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_large_test()
+{
+    vga_printf("kheap large test ... ");
+    // Large requests are whole pages outside the heap, and krealloc moves
+    // blocks across the threshold in both directions.
+    uint32_t heap_blocks = kheap_validate_print(0);
+    uint32_t vmalloc_before = vmalloc_used_pages();
+    uint8_t *large = (uint8_t *)kmalloc(KHEAP_LARGE_THRESHOLD + 1);
+    ASSERT(is_vmalloc_addr(large) && ((uint32_t)large & 0xFFF) == 0);
+    ASSERT(vmalloc_used_pages() == vmalloc_before + KHEAP_LARGE_THRESHOLD / PAGE_SIZE + 1);
+    large[0] = 0x5A;
+    large[KHEAP_LARGE_THRESHOLD] = 0xA5;
+    ASSERT(krealloc(large, KHEAP_LARGE_THRESHOLD + 100) == large);
+    large = (uint8_t *)krealloc(large, 3 * KHEAP_LARGE_THRESHOLD);
+    ASSERT(is_vmalloc_addr(large) && large[0] == 0x5A && large[KHEAP_LARGE_THRESHOLD] == 0xA5);
+    uint8_t *small = (uint8_t *)krealloc(large, 100);
+    ASSERT(!is_vmalloc_addr(small) && small[0] == 0x5A);
+    ASSERT(vmalloc_used_pages() == vmalloc_before);
+    large = (uint8_t *)krealloc(small, 2 * KHEAP_LARGE_THRESHOLD);
+    ASSERT(is_vmalloc_addr(large) && large[0] == 0x5A);
+    void *large_aligned = kmalloc_align(KHEAP_LARGE_THRESHOLD * 2, 4 * PAGE_SIZE);
+    ASSERT(is_vmalloc_addr(large_aligned) && ((uint32_t)large_aligned & (4 * PAGE_SIZE - 1)) == 0);
+    ASSERT(kheap_validate_print(0) == heap_blocks);
+    kfree(large);
+    kfree(large_aligned);
+    ASSERT(vmalloc_used_pages() == vmalloc_before);
+    vga_printf("OK\n");
+}
+
+void kheap_atomic_test()
+{
+    vga_printf("kheap atomic test ... ");
+    // Atomic allocations fall back to the reserve once the magazines are empty
+    // and fail, without blocking, once that is used up too.
+    kheap_drain_magazines();
+    uint32_t home, other;
+    test_arenas(&home, &other);
+    kheap_cpu_cache_t *cc = &cpu_caches[smp_processor_id()];
+    uint32_t exhausted = cc->exhausted;
+    void *atomic[KHEAP_RESERVE_ROUNDS];
+    void *far = kmalloc_arena(other, 48);
+    uint32_t eflags = cpu_save_flags_and_cli();
+    for (uint32_t i = 0; i < KHEAP_RESERVE_ROUNDS; i++)
+    {
+        atomic[i] = kmalloc_atomic(64);
+        ASSERT(atomic[i] != NULL);
+    }
+    ASSERT(kmalloc_atomic(64) == NULL && cc->exhausted == exhausted + 1);
+    ASSERT(kmalloc_atomic(KHEAP_MAG_MAX_SIZE + 1) == NULL);
+    for (uint32_t i = 0; i < KHEAP_RESERVE_ROUNDS; i++)
+    {
+        kfree_atomic(atomic[i]);
+    }
+    kfree_atomic(far); // another arena's object is always deferred
+    set_eflags(eflags);
+    ASSERT(cc->refill_pending);
+    kheap_refill_reserves();
+    ASSERT(cc->reserve_num[magazine_class(64)] == KHEAP_RESERVE_ROUNDS);
+    ASSERT(kheap_validate_print(0) == 0);
+    vga_printf("OK\n");
+}
+
+void kheap_stats_test()
+{
+    vga_printf("kheap stats test ... ");
+    // The counters match the heap: with every allocation freed, all that is
+    // not in holes is the cached magazine objects and reserves.
+    ASSERT(kheap_validate_print(0) == 0);
+    kheap_stats_t stats;
+    kheap_get_stats(&stats);
+    uint32_t cached_bytes = 0;
+    for (uint32_t a = 0; a < KHEAP_ARENA_COUNT; a++)
+    {
+        for (uint32_t start = blocks_start(&arenas[a]); start < blocks_end(&arenas[a]);)
+        {
+            kheap_block_header_t *header = (kheap_block_header_t *)start;
+            cached_bytes += block_in_use(header) ? block_size(header) : 0;
+            start += block_size(header);
+        }
+    }
+    ASSERT(stats.in_use == cached_bytes);
+    ASSERT(stats.largest_hole <= stats.hole_bytes && stats.frag_permille <= 1000);
+    ASSERT(frag_permille(100, 400) == 750 && frag_permille(0xC0000000, 0xF0000000) == 200);
+    ASSERT(stats.large_count == 0 && stats.headroom <= KHEAP_ARENA_SPAN - KHEAP_MIN_SIZE);
+    vga_printf("OK\n");
 }
\ No newline at end of file
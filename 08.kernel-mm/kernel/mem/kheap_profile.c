@@ -0,0 +1,224 @@
+#include "kheap_profile.h"
+
+#ifdef KHEAP_PROFILE
+
+#include "kernel.h"
+#include "vga.h"
+#include "timer.h"
+#include "lock.h"
+#include "string.h"
+#include "ptr_table.h"
+
+STATIC_ASSERT((KHEAP_PROFILE_SLOTS & (KHEAP_PROFILE_SLOTS - 1)) == 0, "profile_slots_must_be_a_power_of_two");
+STATIC_ASSERT((KHEAP_PROFILE_SITES & (KHEAP_PROFILE_SITES - 1)) == 0, "profile_sites_must_be_a_power_of_two");
+
+// Live allocations by pointer.
+static kheap_profile_entry_t entries[KHEAP_PROFILE_SLOTS];
+static ptr_table_t live = PTR_TABLE_INIT(entries, 4);
+static uint32_t live_bytes;
+static uint32_t total_allocs;
+static uint32_t dropped;
+static uint32_t untracked_frees;
+static uint32_t size_hist[KHEAP_PROFILE_BUCKETS]; // all allocations since boot
+
+// The hooks also run for kmalloc_atomic and kfree_atomic.
+static volatile uint32_t profile_lock;
+
+// Per call site totals, built from the live table by a report.
+typedef struct kheap_profile_site
+{
+    uint32_t caller; // 0 marks a free slot
+    uint32_t count;
+    uint32_t bytes;
+} kheap_profile_site_t;
+
+static kheap_profile_site_t sites[KHEAP_PROFILE_SITES];
+static ptr_table_t site_table = PTR_TABLE_INIT(sites, 0);
+
+static inline uint32_t size_bucket(uint32_t size)
+{
+    return size == 0 ? 0 : 31 - __builtin_clz(size);
+}
+
+void kheap_profile_alloc(void *ptr, uint32_t size, uint32_t caller)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    uint32_t eflags = irq_spin_lock(&profile_lock);
+    total_allocs++;
+    size_hist[size_bucket(size)]++;
+    kheap_profile_entry_t *e = ptr_table_insert(&live, (uint32_t)ptr);
+    if (e == NULL)
+    {
+        dropped++;
+        irq_spin_unlock(&profile_lock, eflags);
+        return;
+    }
+    e->caller = caller;
+    e->size = size;
+    e->tick = getTick();
+    live_bytes += size;
+    irq_spin_unlock(&profile_lock, eflags);
+}
+
+void kheap_profile_free(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    uint32_t eflags = irq_spin_lock(&profile_lock);
+    kheap_profile_entry_t *e = ptr_table_find(&live, (uint32_t)ptr);
+    if (e == NULL)
+    {
+        // Allocated while the table was full.
+        untracked_frees++;
+    }
+    else
+    {
+        live_bytes -= e->size;
+        ptr_table_remove(&live, e);
+    }
+    irq_spin_unlock(&profile_lock, eflags);
+}
+
+// Aggregate the live table by call site. Caller holds profile_lock. Returns
+// the number of live allocations whose site did not fit into the table.
+static uint32_t collect_sites()
+{
+    ptr_table_clear(&site_table);
+    uint32_t other = 0;
+    for (uint32_t n = 0; n < KHEAP_PROFILE_SLOTS; n++)
+    {
+        kheap_profile_entry_t *e = &entries[n];
+        if (e->ptr == 0)
+        {
+            continue;
+        }
+        kheap_profile_site_t *site = ptr_table_find(&site_table, e->caller);
+        if (site == NULL)
+        {
+            site = ptr_table_insert(&site_table, e->caller);
+        }
+        if (site == NULL)
+        {
+            other++;
+            continue;
+        }
+        site->count++;
+        site->bytes += e->size;
+    }
+    return other;
+}
+
+// Print the KHEAP_PROFILE_TOP sites with the largest count or byte total.
+static void dump_top_sites(bool_t by_bytes)
+{
+    uint32_t printed[KHEAP_PROFILE_TOP];
+    for (uint32_t t = 0; t < KHEAP_PROFILE_TOP; t++)
+    {
+        int32_t best = -1;
+        for (uint32_t i = 0; i < KHEAP_PROFILE_SITES; i++)
+        {
+            if (sites[i].caller == 0)
+            {
+                continue;
+            }
+            bool_t seen = false;
+            for (uint32_t p = 0; p < t; p++)
+            {
+                seen = seen || (printed[p] == i);
+            }
+            uint32_t key = by_bytes ? sites[i].bytes : sites[i].count;
+            if (!seen && (best < 0 || key > (by_bytes ? sites[best].bytes : sites[best].count)))
+            {
+                best = i;
+            }
+        }
+        if (best < 0)
+        {
+            break;
+        }
+        printed[t] = best;
+        vga_printf("  %x: %d bytes in %d allocations\n", sites[best].caller, sites[best].bytes, sites[best].count);
+    }
+}
+
+void kheap_profile_dump(uint32_t leak_age)
+{
+    uint32_t eflags = irq_spin_lock(&profile_lock);
+    uint32_t now = getTick();
+    vga_printf("kheap profile: %d live allocations, %d bytes; %d allocations total, %d dropped, %d untracked frees\n",
+               live.count, live_bytes, total_allocs, dropped, untracked_frees);
+
+    uint32_t other = collect_sites();
+    vga_printf("top call sites by bytes:\n");
+    dump_top_sites(true);
+    vga_printf("top call sites by count:\n");
+    dump_top_sites(false);
+    if (other > 0)
+    {
+        vga_printf("  (%d allocations from further call sites)\n", other);
+    }
+
+    uint32_t live_hist[KHEAP_PROFILE_BUCKETS];
+    memset(live_hist, 0, sizeof(live_hist));
+    for (uint32_t n = 0; n < KHEAP_PROFILE_SLOTS; n++)
+    {
+        if (entries[n].ptr != 0)
+        {
+            live_hist[size_bucket(entries[n].size)]++;
+        }
+    }
+    vga_printf("size histogram (live/total):\n");
+    for (uint32_t b = 0; b < KHEAP_PROFILE_BUCKETS; b++)
+    {
+        if (size_hist[b] != 0)
+        {
+            vga_printf("  [%d, %d): %d/%d\n", 1U << b, b == 31 ? 0xFFFFFFFF : 1U << (b + 1), live_hist[b], size_hist[b]);
+        }
+    }
+
+    // Leak candidates: the oldest live allocations past leak_age, by insertion
+    // into a list sorted by tick.
+    uint32_t oldest[KHEAP_PROFILE_TOP];
+    uint32_t oldest_num = 0;
+    for (uint32_t n = 0; n < KHEAP_PROFILE_SLOTS; n++)
+    {
+        kheap_profile_entry_t *e = &entries[n];
+        if (e->ptr == 0 || now - e->tick < leak_age)
+        {
+            continue;
+        }
+        uint32_t pos = oldest_num;
+        while (pos > 0 && entries[oldest[pos - 1]].tick > e->tick)
+        {
+            pos--;
+        }
+        if (pos == KHEAP_PROFILE_TOP)
+        {
+            continue;
+        }
+        uint32_t last = oldest_num < KHEAP_PROFILE_TOP ? oldest_num : KHEAP_PROFILE_TOP - 1;
+        for (uint32_t k = last; k > pos; k--)
+        {
+            oldest[k] = oldest[k - 1];
+        }
+        oldest[pos] = n;
+        if (oldest_num < KHEAP_PROFILE_TOP)
+        {
+            oldest_num++;
+        }
+    }
+    vga_printf("leak candidates (older than %d ticks):\n", leak_age);
+    for (uint32_t k = 0; k < oldest_num; k++)
+    {
+        kheap_profile_entry_t *e = &entries[oldest[k]];
+        vga_printf("  %x: %d bytes from %x, %d ticks old\n", e->ptr, e->size, e->caller, now - e->tick);
+    }
+    irq_spin_unlock(&profile_lock, eflags);
+}
+
+#endif // KHEAP_PROFILE
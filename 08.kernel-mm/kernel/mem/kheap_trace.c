@@ -0,0 +1,419 @@
+#include "kheap_trace.h"
+#include "kheap.h"
+#include "kernel.h"
+#include "vmalloc.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "vga.h"
+#include "timer.h"
+#include "cpu.h"
+#include "lock.h"
+#include "ptr_table.h"
+#include "string.h"
+
+STATIC_ASSERT(sizeof(kheap_trace_op_t) == 8, "trace_op_must_stay_compact");
+
+// Ticks the TSC is counted over to find its frequency.
+#define TSC_CALIBRATE_TICKS 5
+
+// Live objects a synthetic trace keeps at most.
+#define SYNTHETIC_LIVE_MAX 512
+
+// num / den without a 64-bit division, which would need libgcc: both are
+// scaled down until they fit into 32 bits.
+static uint32_t div64(uint64_t num, uint64_t den)
+{
+    while (num > 0xFFFFFFFF || den > 0xFFFFFFFF)
+    {
+        num >>= 1;
+        den >>= 1;
+    }
+    return den == 0 ? 0 : (uint32_t)num / (uint32_t)den;
+}
+
+static inline uint32_t log2_bucket(uint32_t value)
+{
+    return value == 0 ? 0 : 31 - __builtin_clz(value);
+}
+
+static inline uint32_t trace_pages(uint32_t bytes)
+{
+    return bytes == 0 ? 1 : ALIGN_UP(bytes, PAGE_SIZE) / PAGE_SIZE;
+}
+
+bool_t kheap_trace_create(kheap_trace_t *trace, uint32_t capacity)
+{
+    memset(trace, 0, sizeof(kheap_trace_t));
+    trace->ops = (kheap_trace_op_t *)vmalloc_pages(trace_pages(capacity * sizeof(kheap_trace_op_t)), 1);
+    if (trace->ops == NULL)
+    {
+        return false;
+    }
+    trace->capacity = capacity;
+    return true;
+}
+
+void kheap_trace_destroy(kheap_trace_t *trace)
+{
+    if (trace->ops != NULL)
+    {
+        vfree_pages(trace->ops, trace_pages(trace->capacity * sizeof(kheap_trace_op_t)));
+        trace->ops = NULL;
+    }
+}
+
+static void trace_append(kheap_trace_t *trace, uint32_t op, uint32_t id, uint32_t size)
+{
+    if (trace->op_num == trace->capacity)
+    {
+        trace->overflow++;
+        return;
+    }
+    kheap_trace_op_t *entry = &trace->ops[trace->op_num++];
+    entry->op = op;
+    entry->id = id;
+    entry->size = size;
+}
+
+// ****************************** synthetic traces ******************************
+static inline uint32_t xorshift32(uint32_t *state)
+{
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+// Mostly small objects, some medium ones and a few large enough for the
+// large-allocation path.
+static uint32_t synthetic_size(uint32_t *state)
+{
+    uint32_t r = xorshift32(state) % 100;
+    if (r < 70)
+    {
+        return 16 + xorshift32(state) % 240;
+    }
+    if (r < 95)
+    {
+        return 257 + xorshift32(state) % 3840;
+    }
+    return 4097 + xorshift32(state) % 61440;
+}
+
+void kheap_trace_synthetic(kheap_trace_t *trace, uint32_t seed)
+{
+    static uint32_t live[SYNTHETIC_LIVE_MAX];
+    uint32_t live_num = 0;
+    uint32_t state = seed != 0 ? seed : 1;
+    trace->op_num = 0;
+    trace->id_num = 0;
+    trace->overflow = 0;
+
+    // Leave room to free whatever is live at the end.
+    while (trace->op_num + live_num < trace->capacity)
+    {
+        uint32_t r = xorshift32(&state) % 100;
+        if (live_num == 0 || (r < 55 && live_num < SYNTHETIC_LIVE_MAX))
+        {
+            live[live_num++] = trace->id_num;
+            trace_append(trace, KHEAP_TRACE_MALLOC, trace->id_num++, synthetic_size(&state));
+            continue;
+        }
+        uint32_t i = xorshift32(&state) % live_num;
+        if (r < 90)
+        {
+            trace_append(trace, KHEAP_TRACE_FREE, live[i], 0);
+            live[i] = live[--live_num];
+        }
+        else
+        {
+            trace_append(trace, KHEAP_TRACE_REALLOC, live[i], synthetic_size(&state));
+        }
+    }
+    while (live_num > 0)
+    {
+        trace_append(trace, KHEAP_TRACE_FREE, live[--live_num], 0);
+    }
+}
+
+// ********************************** replay ***********************************
+static uint32_t tsc_calibrate()
+{
+    uint32_t tick = getTick();
+    while (getTick() == tick)
+    {
+    }
+    uint64_t start = rdtsc();
+    tick = getTick();
+    while (getTick() - tick < TSC_CALIBRATE_TICKS)
+    {
+    }
+    return div64(rdtsc() - start, TSC_CALIBRATE_TICKS);
+}
+
+// Frames taken since the replay started, whether by the heap, by large
+// allocations or by page tables; address space that is never touched or has
+// been trimmed away does not count.
+static void sample_footprint(kheap_bench_result_t *result, uint32_t free_before)
+{
+    uint32_t free_now = pmm_get_free_page_count();
+    uint32_t resident = free_now < free_before ? (free_before - free_now) * PAGE_SIZE : 0;
+    if (resident > result->peak_resident)
+    {
+        kheap_stats_t stats;
+        kheap_get_stats(&stats);
+        result->peak_resident = resident;
+        result->peak_frag_permille = stats.frag_permille;
+    }
+}
+
+// Upper bound of the histogram bucket that holds the given share of operations.
+static uint32_t percentile(const kheap_bench_result_t *result, uint32_t percent)
+{
+    uint32_t seen = 0;
+    for (uint32_t b = 0; b < KHEAP_TRACE_BUCKETS; b++)
+    {
+        seen += result->hist[b];
+        if (seen * 100 >= result->ops * percent)
+        {
+            return b == 31 ? 0xFFFFFFFF : 1U << (b + 1);
+        }
+    }
+    return 0xFFFFFFFF;
+}
+
+bool_t kheap_trace_replay(const kheap_trace_t *trace, kheap_bench_result_t *result)
+{
+    memset(result, 0, sizeof(kheap_bench_result_t));
+    uint32_t table_pages = trace_pages(trace->id_num * sizeof(void *));
+    void **objs = (void **)vmalloc_pages(table_pages, 1);
+    if (objs == NULL)
+    {
+        return false;
+    }
+    memset(objs, 0, table_pages * PAGE_SIZE);
+    result->tsc_per_tick = tsc_calibrate();
+    uint32_t free_before = pmm_get_free_page_count();
+
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < trace->op_num; i++)
+    {
+        const kheap_trace_op_t *op = &trace->ops[i];
+        void *obj = NULL;
+        uint64_t t0 = rdtsc();
+        switch (op->op)
+        {
+        case KHEAP_TRACE_MALLOC:
+            obj = objs[op->id] = kmalloc(op->size);
+            break;
+        case KHEAP_TRACE_FREE:
+            kfree(objs[op->id]);
+            objs[op->id] = NULL;
+            break;
+        default:
+            obj = krealloc(objs[op->id], op->size);
+            break;
+        }
+        uint32_t cycles = (uint32_t)(rdtsc() - t0);
+        total += cycles;
+        result->hist[log2_bucket(cycles)]++;
+
+        if (op->op != KHEAP_TRACE_FREE)
+        {
+            if (obj == NULL)
+            {
+                // A failed realloc leaves the old object live, to be freed later.
+                result->failed++;
+            }
+            else
+            {
+                objs[op->id] = obj;
+                // Touch the object like a real user would, outside the timed part.
+                *(uint8_t *)obj = (uint8_t)i;
+            }
+        }
+        if (i % KHEAP_TRACE_SAMPLE_OPS == 0)
+        {
+            sample_footprint(result, free_before);
+        }
+    }
+    sample_footprint(result, free_before);
+
+    for (uint32_t id = 0; id < trace->id_num; id++)
+    {
+        kfree(objs[id]);
+    }
+    vfree_pages(objs, table_pages);
+
+    result->ops = trace->op_num;
+    result->cycles_per_op = div64(total, result->ops);
+    result->ops_per_sec = div64((uint64_t)result->ops * result->tsc_per_tick * TIMER_FREQUENCY, total);
+    result->p50_cycles = percentile(result, 50);
+    result->p99_cycles = percentile(result, 99);
+    return true;
+}
+
+void kheap_bench_print(const kheap_bench_result_t *result)
+{
+    vga_printf("kheap bench: %d ops (%d failed), %d ops/s, %d cycles/op, p50 < %d, p99 < %d cycles\n",
+               result->ops, result->failed, result->ops_per_sec, result->cycles_per_op,
+               result->p50_cycles, result->p99_cycles);
+    vga_printf("  peak resident %dKB, fragmentation at peak %d.%d%%\n", result->peak_resident / KIB,
+               result->peak_frag_permille / 10, result->peak_frag_permille % 10);
+    vga_printf("  latency histogram (cycles):");
+    for (uint32_t b = 0; b < KHEAP_TRACE_BUCKETS; b++)
+    {
+        if (result->hist[b] != 0)
+        {
+            vga_printf(" %d+:%d", 1U << b, result->hist[b]);
+        }
+    }
+    vga_printf("\n");
+}
+
+void kheap_bench()
+{
+    kheap_trace_t trace;
+    kheap_bench_result_t result;
+    if (!kheap_trace_create(&trace, 16384))
+    {
+        vga_printf("kheap bench: no memory for the trace\n");
+        return;
+    }
+    kheap_trace_synthetic(&trace, 1);
+    if (kheap_trace_replay(&trace, &result))
+    {
+        kheap_bench_print(&result);
+    }
+    kheap_trace_destroy(&trace);
+}
+
+// ********************************* recording *********************************
+#ifdef KHEAP_TRACE
+
+typedef struct kheap_trace_slot
+{
+    uint32_t ptr; // 0 marks a free slot
+    uint32_t id;
+} kheap_trace_slot_t;
+
+STATIC_ASSERT((KHEAP_TRACE_SLOTS & (KHEAP_TRACE_SLOTS - 1)) == 0, "trace_slots_must_be_a_power_of_two");
+
+static kheap_trace_t *recording;
+// Live objects by pointer, with the id of the malloc that created them.
+static kheap_trace_slot_t slots[KHEAP_TRACE_SLOTS];
+static ptr_table_t live = PTR_TABLE_INIT(slots, 4);
+
+// The hooks also run for kmalloc_atomic and kfree_atomic.
+static volatile uint32_t trace_lock;
+
+static bool_t slot_insert(uint32_t ptr, uint32_t id)
+{
+    kheap_trace_slot_t *slot = ptr_table_insert(&live, ptr);
+    if (slot == NULL)
+    {
+        recording->overflow++;
+        return false;
+    }
+    slot->id = id;
+    return true;
+}
+
+static void record_alloc(void *ptr, uint32_t size)
+{
+    // An object the table cannot hold would never get its free recorded and
+    // leak on replay, so its malloc is dropped as well.
+    if (slot_insert((uint32_t)ptr, recording->id_num))
+    {
+        trace_append(recording, KHEAP_TRACE_MALLOC, recording->id_num++, size);
+    }
+}
+
+void kheap_trace_record_start(kheap_trace_t *trace)
+{
+    uint32_t eflags = irq_spin_lock(&trace_lock);
+    ptr_table_clear(&live);
+    trace->op_num = 0;
+    trace->id_num = 0;
+    trace->overflow = 0;
+    recording = trace;
+    irq_spin_unlock(&trace_lock, eflags);
+}
+
+void kheap_trace_record_stop()
+{
+    uint32_t eflags = irq_spin_lock(&trace_lock);
+    recording = NULL;
+    irq_spin_unlock(&trace_lock, eflags);
+}
+
+void kheap_trace_on_alloc(void *ptr, uint32_t size)
+{
+    if (recording == NULL || ptr == NULL)
+    {
+        return;
+    }
+    uint32_t eflags = irq_spin_lock(&trace_lock);
+    if (recording != NULL)
+    {
+        record_alloc(ptr, size);
+    }
+    irq_spin_unlock(&trace_lock, eflags);
+}
+
+void kheap_trace_on_free(void *ptr)
+{
+    if (recording == NULL || ptr == NULL)
+    {
+        return;
+    }
+    uint32_t eflags = irq_spin_lock(&trace_lock);
+    // Objects allocated before recording started are not in the table.
+    kheap_trace_slot_t *slot = recording != NULL ? ptr_table_find(&live, (uint32_t)ptr) : NULL;
+    if (slot != NULL)
+    {
+        trace_append(recording, KHEAP_TRACE_FREE, slot->id, 0);
+        ptr_table_remove(&live, slot);
+    }
+    irq_spin_unlock(&trace_lock, eflags);
+}
+
+void kheap_trace_on_realloc(void *old_ptr, void *new_ptr, uint32_t size)
+{
+    if (old_ptr == NULL)
+    {
+        kheap_trace_on_alloc(new_ptr, size);
+        return;
+    }
+    if (size == 0)
+    {
+        kheap_trace_on_free(old_ptr);
+        return;
+    }
+    if (recording == NULL || new_ptr == NULL)
+    {
+        return;
+    }
+    uint32_t eflags = irq_spin_lock(&trace_lock);
+    if (recording != NULL)
+    {
+        kheap_trace_slot_t *slot = ptr_table_find(&live, (uint32_t)old_ptr);
+        if (slot == NULL)
+        {
+            // The object predates the recording: it starts here.
+            record_alloc(new_ptr, size);
+        }
+        else
+        {
+            uint32_t id = slot->id;
+            ptr_table_remove(&live, slot);
+            slot_insert((uint32_t)new_ptr, id); // reuses the slot just freed
+            trace_append(recording, KHEAP_TRACE_REALLOC, id, size);
+        }
+    }
+    irq_spin_unlock(&trace_lock, eflags);
+}
+
+#endif // KHEAP_TRACE
@@ -0,0 +1,84 @@
+/**
+ * @file kmap.c
+ * @brief 临时映射 (kmap_atomic) 实现
+ */
+
+#include "kmap.h"
+#include "vmm.h"
+#include "string.h"
+
+STATIC_ASSERT(NR_CPUS * KMAP_SLOTS_PER_CPU * PAGE_SIZE <= FIXMAP_END - FIXMAP_START,
+              "fixmap_window_too_small");
+
+/**
+ * @brief 每个 CPU 当前已使用的槽数（栈顶）
+ */
+static volatile uint32_t kmap_depth[NR_CPUS];
+
+static inline uint32_t kmap_slot_addr(uint32_t cpu, uint32_t slot)
+{
+    return FIXMAP_START + (cpu * KMAP_SLOTS_PER_CPU + slot) * PAGE_SIZE;
+}
+
+void kmap_init(void)
+{
+    for (uint32_t cpu = 0; cpu < NR_CPUS; cpu++)
+    {
+        kmap_depth[cpu] = 0;
+    }
+    // 窗口内的缺页一定是误用（访问了已解除的槽），不允许按需分页
+    vmm_region_register("fixmap", FIXMAP_START, FIXMAP_END, 0);
+}
+
+void *kmap_atomic(uint32_t paddr)
+{
+    ASSERT((paddr & 0xFFF) == 0);
+
+    uint32_t cpu = smp_processor_id();
+    uint32_t slot = kmap_depth[cpu]++;
+    ASSERT(slot < KMAP_SLOTS_PER_CPU);
+
+    uint32_t vaddr = kmap_slot_addr(cpu, slot);
+    page_table_entry_t *pte = vmm_get_pte(vaddr);
+    ASSERT(pte != NULL && !pte->present);
+
+    // 槽位在解除映射时已经 invlpg，TLB 中不会有它的条目，这里直接写入即可
+    page_table_entry_t entry = {0};
+    entry.frame_addr = paddr >> 12;
+    entry.present = 1;
+    entry.rw = 1;
+    *pte = entry;
+
+    return (void *)vaddr;
+}
+
+void kunmap_atomic(void *vaddr)
+{
+    uint32_t cpu = smp_processor_id();
+    ASSERT(kmap_depth[cpu] > 0);
+
+    uint32_t slot = kmap_depth[cpu] - 1;
+    ASSERT(PAGE_ALIGN_DOWN((uint32_t)vaddr) == kmap_slot_addr(cpu, slot));
+
+    page_table_entry_t *pte = vmm_get_pte(kmap_slot_addr(cpu, slot));
+    *pte = (page_table_entry_t){0};
+    asm volatile("invlpg (%0)" : : "r"(kmap_slot_addr(cpu, slot)) : "memory");
+
+    kmap_depth[cpu] = slot;
+}
+
+void kmap_zero_frame(uint32_t paddr)
+{
+    void *va = kmap_atomic(paddr);
+    memzero(va, PAGE_SIZE);
+    kunmap_atomic(va);
+}
+
+void kmap_copy_frame(uint32_t dst_paddr, uint32_t src_paddr)
+{
+    void *dst = kmap_atomic(dst_paddr);
+    void *src = kmap_atomic(src_paddr);
+    memcpy(dst, src, PAGE_SIZE);
+    kunmap_atomic(src);
+    kunmap_atomic(dst);
+}
@@ -0,0 +1,230 @@
+/**
+ * @file page_idle.c
+ * @brief 空闲页跟踪 / 工作集估算 实现
+ */
+
+#include "page_idle.h"
+#include "timer.h"
+#include "lock.h"
+#include "vga.h"
+#include "string.h"
+
+/**
+ * @brief 已发布的统计（上一轮完整扫描的结果）
+ */
+static page_idle_stats_t idle_stats[VMM_MAX_REGIONS];
+
+/**
+ * @brief 正在进行中的一轮扫描的累加器
+ */
+static page_idle_stats_t idle_accum[VMM_MAX_REGIONS];
+
+/**
+ * @brief 扫描游标：当前区域下标与下一个要检查的虚拟地址
+ */
+static uint32_t cursor_region = 0;
+static uint32_t cursor_addr = 0;
+
+/**
+ * @brief 采样一个页表项：读取并清除访问位，更新空闲代数
+ *
+ * @return uint32_t 更新后的空闲代数
+ */
+static uint32_t sample_pte(page_table_entry_t *pte, uint32_t vaddr)
+{
+    uint32_t pte_addr = (uint32_t)pte;
+    volatile uint32_t *raw = (volatile uint32_t *)pte_addr;
+    uint32_t old = *raw;
+    uint32_t age = (old & PAGE_IDLE_AGE_MASK) >> PAGE_IDLE_AGE_SHIFT;
+
+    if (old & PAGE_ACCESSED)
+    {
+        age = 0;
+    }
+    else if (age < PAGE_IDLE_AGE_MAX)
+    {
+        age++;
+    }
+
+    uint32_t new = (old & ~(PAGE_ACCESSED | PAGE_IDLE_AGE_MASK)) | (age << PAGE_IDLE_AGE_SHIFT);
+    if (new != old && compare_and_exchange(raw, old, new) && (old & PAGE_ACCESSED))
+    {
+        // TLB 中缓存的条目已带有 A 位，CPU 不会再次设置它；
+        // 只有真正清除了 A 位的页才需要失效，未访问的页不产生任何 TLB 开销。
+        asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+    }
+    return age;
+}
+
+/**
+ * @brief 当前区域扫描完毕：发布统计并记录历史
+ */
+static void finish_region(uint32_t index)
+{
+    page_idle_stats_t *acc = &idle_accum[index];
+    page_idle_stats_t *pub = &idle_stats[index];
+
+    pub->resident = acc->resident;
+    pub->hot = acc->hot;
+    pub->warm = acc->warm;
+    pub->cold = acc->cold;
+    pub->passes++;
+
+    page_idle_sample_t *sample = &pub->history[pub->history_num % PAGE_IDLE_HISTORY];
+    sample->tick = getTick();
+    sample->ws_pages = acc->hot + acc->warm;
+    pub->history_num++;
+
+    memset(acc, 0, sizeof(*acc));
+}
+
+/**
+ * @brief 把游标移到下一个被跟踪的区域
+ */
+static void advance_region(void)
+{
+    for (uint32_t n = 0; n < VMM_MAX_REGIONS; n++)
+    {
+        cursor_region = (cursor_region + 1) % VMM_MAX_REGIONS;
+        vmm_region_t *region = vmm_region_get(cursor_region);
+        if (region != NULL && (region->flags & VMM_REGION_TRACK_IDLE))
+        {
+            cursor_addr = region->start;
+            return;
+        }
+    }
+    cursor_addr = 0;
+}
+
+void page_idle_scan(uint32_t budget)
+{
+    uint32_t zero_frame = vmm_zero_page_phys() >> PAGE_SHIFT;
+
+    while (budget > 0)
+    {
+        vmm_region_t *region = vmm_region_get(cursor_region);
+        if (region == NULL || !(region->flags & VMM_REGION_TRACK_IDLE) ||
+            cursor_addr < region->start || cursor_addr >= region->end)
+        {
+            advance_region();
+            region = vmm_region_get(cursor_region);
+            if (region == NULL || !(region->flags & VMM_REGION_TRACK_IDLE))
+            {
+                return; // 没有需要跟踪的区域
+            }
+        }
+
+        page_idle_stats_t *acc = &idle_accum[cursor_region];
+        for (; budget > 0 && cursor_addr < region->end; budget--, cursor_addr += PAGE_SIZE)
+        {
+            page_directory_entry_t *pde = vmm_get_pde(cursor_addr);
+            if (pde_is_large(pde))
+            {
+                // 大页只有一个访问位，整体采样，剩余部分按相同代数计入
+                uint32_t next = ((cursor_addr >> 22) + 1) << 22;
+                uint32_t pages = (MIN(next, region->end) - cursor_addr) / PAGE_SIZE;
+                uint32_t age = sample_pte(pde, cursor_addr);
+                acc->resident += pages;
+                if (age == 0)
+                    acc->hot += pages;
+                else if (age <= PAGE_IDLE_WARM_AGE)
+                    acc->warm += pages;
+                else
+                    acc->cold += pages;
+                cursor_addr += (pages - 1) * PAGE_SIZE;
+                continue;
+            }
+
+            page_table_entry_t *pte = vmm_get_pte(cursor_addr);
+            if (pte == NULL)
+            {
+                // 整个页表不存在，跳到下一个 4MB 边界
+                cursor_addr = ((cursor_addr >> 22) + 1) << 22;
+                cursor_addr -= PAGE_SIZE;
+                continue;
+            }
+            if (!pte->present || pte->frame_addr == zero_frame)
+            {
+                continue;
+            }
+
+            uint32_t age = sample_pte(pte, cursor_addr);
+            acc->resident++;
+            if (age == 0)
+                acc->hot++;
+            else if (age <= PAGE_IDLE_WARM_AGE)
+                acc->warm++;
+            else
+                acc->cold++;
+        }
+
+        if (cursor_addr >= region->end)
+        {
+            finish_region(cursor_region);
+            advance_region();
+        }
+    }
+}
+
+static void page_idle_tick(uint32_t tick)
+{
+    page_idle_scan(PAGE_IDLE_SCAN_BATCH);
+}
+
+void page_idle_init(void)
+{
+    memset(idle_stats, 0, sizeof(idle_stats));
+    memset(idle_accum, 0, sizeof(idle_accum));
+    cursor_region = VMM_MAX_REGIONS - 1;
+    advance_region();
+
+    if (!timer_add_hook(page_idle_tick))
+    {
+        vga_printf("[IDLE] No free timer hook, page idle tracking disabled.\n");
+        return;
+    }
+    vga_printf("[IDLE] Page idle tracking: %d PTEs per tick.\n", PAGE_IDLE_SCAN_BATCH);
+}
+
+bool_t page_idle_get_stats(uint32_t region_index, page_idle_stats_t *stats)
+{
+    vmm_region_t *region = vmm_region_get(region_index);
+    if (region == NULL || !(region->flags & VMM_REGION_TRACK_IDLE))
+    {
+        return false;
+    }
+
+    // 统计由时钟中断更新，拷贝期间关中断以得到一致的快照
+    uint32_t eflags = cpu_save_flags_and_cli();
+    *stats = idle_stats[region_index];
+    set_eflags(eflags);
+    return true;
+}
+
+void page_idle_dump(void)
+{
+    vga_printf("========== page idle ==========\n");
+    for (uint32_t i = 0; i < VMM_MAX_REGIONS; i++)
+    {
+        page_idle_stats_t stats;
+        if (!page_idle_get_stats(i, &stats))
+        {
+            continue;
+        }
+
+        vmm_region_t *region = vmm_region_get(i);
+        vga_printf("%s: passes=%d resident=%d hot=%d warm=%d cold=%d wss=%d KiB\n",
+                   region->name, stats.passes, stats.resident, stats.hot, stats.warm, stats.cold,
+                   (stats.hot + stats.warm) * PAGE_SIZE / KIB);
+
+        uint32_t first = stats.history_num > PAGE_IDLE_HISTORY ? stats.history_num - PAGE_IDLE_HISTORY : 0;
+        vga_printf("  wss history:");
+        for (uint32_t n = first; n < stats.history_num; n++)
+        {
+            page_idle_sample_t *s = &stats.history[n % PAGE_IDLE_HISTORY];
+            vga_printf(" %d@%d", s->ws_pages * PAGE_SIZE / KIB, s->tick);
+        }
+        vga_printf("\n");
+    }
+    vga_printf("===============================\n");
+}
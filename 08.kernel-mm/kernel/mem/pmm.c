@@ -207,6 +207,47 @@ uint32_t pmm_alloc_page(void)
     return 0;
 }
 
+bool_t pmm_alloc_pages(uint32_t *frames, uint32_t count)
+{
+    if (count == 0)
+        return true;
+    if (pmm_free_pages < count || pmm_max_ram_page == 0)
+        return false;
+
+    uint32_t got = 0;
+    uint32_t start = pmm_last_alloc_index % pmm_max_ram_page;
+    uint32_t i = start;
+    do
+    {
+        // 整字节都已使用时一次跳过 8 页（不能越过扫描起点，否则循环无法终止）
+        if ((i % 8) == 0 && i + 8 <= pmm_max_ram_page && pmm_bitmap[i / 8] == 0xFF &&
+            !(start > i && start < i + 8))
+        {
+            i = (i + 8) % pmm_max_ram_page;
+            continue;
+        }
+        if (i >= (LOW_MEMORY_SIZE / PAGE_SIZE) && !pmm_test_bit(i))
+        {
+            pmm_set_bit(i);
+            frames[got++] = i * PAGE_SIZE;
+            if (got == count)
+            {
+                pmm_free_pages -= count;
+                pmm_last_alloc_index = i;
+                return true;
+            }
+        }
+        i = (i + 1) % pmm_max_ram_page;
+    } while (i != start);
+
+    // pmm_free_pages 与位图不一致时才会走到这里：回滚
+    for (uint32_t k = 0; k < got; k++)
+    {
+        pmm_clear_bit(frames[k] / PAGE_SIZE);
+    }
+    return false;
+}
+
 void pmm_free_page(uint32_t paddr)
 {
     if (paddr % PAGE_SIZE != 0)
@@ -227,6 +268,62 @@ void pmm_free_page(uint32_t paddr)
     pmm_free_pages++;
 }
 
+/**
+ * @brief 检查 [start, start + count) 是否全部空闲
+ * @return uint32_t 全部空闲时返回 0；否则返回最后一个已使用页相对 start 的偏移 + 1，
+ *         调用者可以据此跳过不可能满足条件的起点。
+ */
+static uint32_t pmm_check_run(uint32_t start, uint32_t count)
+{
+    for (uint32_t i = count; i > 0; i--)
+    {
+        uint32_t p = start + i - 1;
+        // 整字节为 0 时一次跳过 8 页
+        if ((p % 8) == 7 && i >= 8 && pmm_bitmap[p / 8] == 0)
+        {
+            i -= 7;
+            continue;
+        }
+        if (pmm_test_bit(p))
+        {
+            return i;
+        }
+    }
+    return 0;
+}
+
+uint32_t pmm_alloc_contiguous(uint32_t count, uint32_t align_pages)
+{
+    if (count == 0 || pmm_free_pages < count)
+        return 0;
+
+    uint32_t start = ALIGN_UP(LOW_MEMORY_SIZE / PAGE_SIZE, align_pages);
+    while (start + count <= pmm_max_ram_page)
+    {
+        uint32_t used = pmm_check_run(start, count);
+        if (used == 0)
+        {
+            for (uint32_t p = start; p < start + count; p++)
+            {
+                pmm_set_bit(p);
+            }
+            pmm_free_pages -= count;
+            return start * PAGE_SIZE;
+        }
+        // 已使用页之前的任何起点都不可能成功
+        start = ALIGN_UP(start + used, align_pages);
+    }
+    return 0;
+}
+
+void pmm_free_contiguous(uint32_t paddr, uint32_t count)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        pmm_free_page(paddr + i * PAGE_SIZE);
+    }
+}
+
 uint32_t pmm_get_free_page_count(void)
 {
     return pmm_free_pages;
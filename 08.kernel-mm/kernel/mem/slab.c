@@ -0,0 +1,387 @@
+/**
+ * @file slab.c
+ * @brief Slab 分配器实现
+ */
+
+#include "slab.h"
+#include "vmalloc.h"
+#include "vmm.h"
+#include "vga.h"
+#include "string.h"
+
+/**
+ * @brief 管理 kmem_cache_t 自身的 cache（自举用，静态分配）
+ */
+static kmem_cache_t cache_cache;
+
+/**
+ * @brief 所有 cache 组成的链表，仅用于调试输出
+ */
+static kmem_cache_t *cache_chain = NULL;
+static yieldlock_t cache_chain_lock;
+
+#define SLAB_DESC_SIZE ALIGN_UP(sizeof(slab_t), sizeof(void *))
+
+// ====================================================================
+// slab 链表
+// ====================================================================
+
+static void slab_list_add(slab_list_t *list, slab_t *slab)
+{
+    slab->prev = NULL;
+    slab->next = list->head;
+    if (list->head != NULL)
+    {
+        list->head->prev = slab;
+    }
+    list->head = slab;
+    list->count++;
+}
+
+static void slab_list_del(slab_list_t *list, slab_t *slab)
+{
+    if (slab->prev != NULL)
+    {
+        slab->prev->next = slab->next;
+    }
+    else
+    {
+        list->head = slab->next;
+    }
+    if (slab->next != NULL)
+    {
+        slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = NULL;
+    list->count--;
+}
+
+// ====================================================================
+// slab 的创建与销毁
+// ====================================================================
+
+static inline slab_t *obj_to_slab(kmem_cache_t *cache, void *obj)
+{
+    return (slab_t *)ALIGN_DOWN(obj, cache->slab_pages * PAGE_SIZE);
+}
+
+/**
+ * @brief 空闲对象的链接指针所在的字
+ */
+static inline void **obj_free_link(kmem_cache_t *cache, void *obj)
+{
+    return (void **)((uint8_t *)obj + cache->free_offset);
+}
+
+/**
+ * @brief 计算 cache 的 slab 布局：每个 slab 的页数、对象数与可用着色范围
+ */
+static void cache_compute_layout(kmem_cache_t *cache)
+{
+    uint32_t pages = 1;
+    while ((pages * PAGE_SIZE - SLAB_DESC_SIZE) / cache->obj_size < SLAB_MIN_OBJS &&
+           pages * PAGE_SIZE < 64 * PAGE_SIZE)
+    {
+        pages <<= 1;
+    }
+
+    uint32_t usable = pages * PAGE_SIZE - ALIGN_UP(SLAB_DESC_SIZE, cache->align);
+    cache->slab_pages = pages;
+    cache->objs_per_slab = usable / cache->obj_size;
+    cache->color_max = usable - cache->objs_per_slab * cache->obj_size;
+    cache->color_next = 0;
+}
+
+/**
+ * @brief 为 cache 新建一个 slab：分配页、着色、串起空闲链表并调用构造函数
+ */
+static slab_t *cache_grow(kmem_cache_t *cache)
+{
+    slab_t *slab = (slab_t *)vmalloc_pages(cache->slab_pages, cache->slab_pages);
+    if (slab == NULL)
+    {
+        return NULL;
+    }
+
+    slab->cache = cache;
+    slab->inuse = 0;
+    slab->color = cache->color_next;
+    cache->color_next += cache->align;
+    if (cache->color_next > cache->color_max)
+    {
+        cache->color_next = 0;
+    }
+
+    uint8_t *first = (uint8_t *)ALIGN_UP((uint32_t)slab + SLAB_DESC_SIZE, cache->align) + slab->color;
+    slab->freelist = NULL;
+    for (int32_t i = cache->objs_per_slab - 1; i >= 0; i--)
+    {
+        void *obj = first + i * cache->obj_size;
+        if (cache->ctor != NULL)
+        {
+            cache->ctor(obj);
+        }
+        // 有构造函数时链接指针在对象之后，不会覆盖构造出的状态
+        *obj_free_link(cache, obj) = slab->freelist;
+        slab->freelist = obj;
+    }
+
+    cache->total_objs += cache->objs_per_slab;
+    return slab;
+}
+
+static void cache_shrink_slab(kmem_cache_t *cache, slab_t *slab)
+{
+    cache->total_objs -= cache->objs_per_slab;
+    vfree_pages(slab, cache->slab_pages);
+}
+
+// ====================================================================
+// 公共接口
+// ====================================================================
+
+static void cache_setup(kmem_cache_t *cache, const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    memset(cache, 0, sizeof(*cache));
+    strncpy(cache->name, name, KMEM_CACHE_NAME_LEN - 1);
+    cache->align = align;
+    if (ctor != NULL)
+    {
+        // 构造出的状态要跨越释放保留下来，链接指针放在对象之后的一个字里
+        cache->free_offset = ALIGN_UP(size, sizeof(void *));
+        cache->obj_size = ALIGN_UP(cache->free_offset + sizeof(void *), align);
+    }
+    else
+    {
+        // 空闲对象至少要放得下一个链接指针
+        cache->free_offset = 0;
+        cache->obj_size = ALIGN_UP(MAX(size, (uint32_t)sizeof(void *)), align);
+    }
+    cache->ctor = ctor;
+    yieldlock_init(&cache->lock);
+    cache_compute_layout(cache);
+
+    yieldlock_lock(&cache_chain_lock);
+    cache->next = cache_chain;
+    cache_chain = cache;
+    yieldlock_unlock(&cache_chain_lock);
+}
+
+void kmem_cache_init(void)
+{
+    yieldlock_init(&cache_chain_lock);
+    cache_chain = NULL;
+    cache_setup(&cache_cache, "kmem_cache", sizeof(kmem_cache_t), sizeof(void *), NULL);
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align, kmem_ctor_t ctor)
+{
+    if (align == 0)
+    {
+        align = sizeof(void *);
+    }
+    if (size == 0 || (align & (align - 1)) != 0 || size > 16 * PAGE_SIZE || align > PAGE_SIZE)
+    {
+        return NULL;
+    }
+
+    kmem_cache_t *cache = (kmem_cache_t *)kmem_cache_alloc(&cache_cache);
+    if (cache == NULL)
+    {
+        return NULL;
+    }
+    cache_setup(cache, name, size, align, ctor);
+    return cache;
+}
+
+void kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (cache == NULL)
+    {
+        return;
+    }
+    ASSERT(cache->active_objs == 0);
+
+    yieldlock_lock(&cache_chain_lock);
+    kmem_cache_t **pp = &cache_chain;
+    while (*pp != NULL && *pp != cache)
+    {
+        pp = &(*pp)->next;
+    }
+    if (*pp == cache)
+    {
+        *pp = cache->next;
+    }
+    yieldlock_unlock(&cache_chain_lock);
+
+    while (cache->empty.head != NULL)
+    {
+        slab_t *slab = cache->empty.head;
+        slab_list_del(&cache->empty, slab);
+        cache_shrink_slab(cache, slab);
+    }
+    kmem_cache_free(&cache_cache, cache);
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    yieldlock_lock(&cache->lock);
+
+    slab_t *slab = cache->partial.head;
+    if (slab == NULL)
+    {
+        slab = cache->empty.head;
+        if (slab != NULL)
+        {
+            slab_list_del(&cache->empty, slab);
+        }
+        else
+        {
+            slab = cache_grow(cache);
+            if (slab == NULL)
+            {
+                yieldlock_unlock(&cache->lock);
+                return NULL;
+            }
+        }
+        slab_list_add(&cache->partial, slab);
+    }
+
+    void *obj = slab->freelist;
+    slab->freelist = *obj_free_link(cache, obj);
+    slab->inuse++;
+    cache->active_objs++;
+
+    if (slab->inuse == cache->objs_per_slab)
+    {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+
+    yieldlock_unlock(&cache->lock);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (obj == NULL)
+    {
+        return;
+    }
+
+    slab_t *slab = obj_to_slab(cache, obj);
+    ASSERT(slab->cache == cache);
+
+    yieldlock_lock(&cache->lock);
+
+    if (slab->inuse == cache->objs_per_slab)
+    {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *obj_free_link(cache, obj) = slab->freelist;
+    slab->freelist = obj;
+    slab->inuse--;
+    cache->active_objs--;
+
+    if (slab->inuse == 0)
+    {
+        slab_list_del(&cache->partial, slab);
+        if (cache->empty.count < SLAB_MAX_EMPTY)
+        {
+            slab_list_add(&cache->empty, slab);
+        }
+        else
+        {
+            cache_shrink_slab(cache, slab);
+        }
+    }
+
+    yieldlock_unlock(&cache->lock);
+}
+
+void kmem_cache_dump(void)
+{
+    vga_printf("========== slab caches ==========\n");
+    yieldlock_lock(&cache_chain_lock);
+    for (kmem_cache_t *c = cache_chain; c != NULL; c = c->next)
+    {
+        vga_printf("%s: size=%d objs=%d/%d slabs=%d/%d/%d (full/partial/empty) pages/slab=%d\n",
+                   c->name, c->obj_size, c->active_objs, c->total_objs,
+                   c->full.count, c->partial.count, c->empty.count, c->slab_pages);
+    }
+    yieldlock_unlock(&cache_chain_lock);
+    vga_printf("=================================\n");
+}
+
+// ******************************** unit tests **********************************
+static uint32_t slab_test_ctor_calls = 0;
+
+static void slab_test_ctor(void *obj)
+{
+    memset(obj, 0xAB, 48);
+    slab_test_ctor_calls++;
+}
+
+void slab_test()
+{
+    vga_printf("slab test ... ");
+
+    kmem_cache_t *cache = kmem_cache_create("test48", 48, SLAB_CACHE_LINE, slab_test_ctor);
+    ASSERT(cache != NULL);
+    ASSERT(cache->obj_size == 64);
+
+    // Fill several slabs, then check alignment and that objects never overlap.
+    uint32_t num = cache->objs_per_slab * 3 + 1;
+    uint8_t *objs[num];
+    for (uint32_t i = 0; i < num; i++)
+    {
+        objs[i] = (uint8_t *)kmem_cache_alloc(cache);
+        ASSERT(objs[i] != NULL);
+        ASSERT(((uint32_t)objs[i] & (SLAB_CACHE_LINE - 1)) == 0);
+        ASSERT(objs[i][8] == 0xAB);
+        objs[i][8] = (uint8_t)i;
+    }
+    for (uint32_t i = 0; i < num; i++)
+    {
+        ASSERT(objs[i][8] == (uint8_t)i);
+    }
+    ASSERT(cache->active_objs == num);
+    ASSERT(slab_test_ctor_calls == cache->total_objs);
+
+    // Consecutive slabs start at different colors.
+    slab_t *s0 = obj_to_slab(cache, objs[0]);
+    slab_t *s1 = obj_to_slab(cache, objs[cache->objs_per_slab]);
+    ASSERT(s0 != s1);
+    ASSERT(cache->color_max < cache->align || s0->color != s1->color);
+
+    // Freed objects are reused without calling the constructor again, and
+    // come back in the constructed state they were freed in.
+    uint32_t ctor_calls = slab_test_ctor_calls;
+    for (uint32_t i = 0; i < num; i += 2)
+    {
+        objs[i][8] = 0xAB;
+        kmem_cache_free(cache, objs[i]);
+    }
+    for (uint32_t i = 0; i < num; i += 2)
+    {
+        objs[i] = (uint8_t *)kmem_cache_alloc(cache);
+        for (uint32_t b = 0; b < 48; b++)
+        {
+            ASSERT(objs[i][b] == 0xAB);
+        }
+    }
+    ASSERT(slab_test_ctor_calls == ctor_calls);
+
+    for (uint32_t i = 0; i < num; i++)
+    {
+        kmem_cache_free(cache, objs[i]);
+    }
+    ASSERT(cache->active_objs == 0);
+    ASSERT(cache->full.count == 0 && cache->partial.count == 0);
+    ASSERT(cache->empty.count <= SLAB_MAX_EMPTY);
+
+    kmem_cache_destroy(cache);
+    vga_printf("OK\n");
+}
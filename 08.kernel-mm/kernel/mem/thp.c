@@ -0,0 +1,200 @@
+/**
+ * @file thp.c
+ * @brief 透明大页实现
+ */
+
+#include "thp.h"
+#include "pmm.h"
+#include "kmap.h"
+#include "timer.h"
+#include "lock.h"
+#include "vga.h"
+
+thp_stats_t thp_stats;
+
+/**
+ * @brief khugepaged 的扫描游标
+ */
+static uint32_t collapse_region = 0;
+static uint32_t collapse_addr = 0;
+static uint32_t collapse_last_tick = 0;
+
+/**
+ * @brief 统计一个 4MB 范围中映射了真实物理页（非共享零页）的页数
+ *
+ * @param stop_at 数到这么多即停止，用于只需判断“是否为空”的场景
+ */
+static uint32_t count_real_pages(uint32_t base, uint32_t stop_at)
+{
+    page_table_entry_t *table = vmm_get_pte(base);
+    if (table == NULL)
+    {
+        return LARGE_PAGE_PAGES; // 已是大页或没有页表，视为不可用
+    }
+
+    uint32_t zero_frame = vmm_zero_page_phys() >> PAGE_SHIFT;
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < LARGE_PAGE_PAGES && count < stop_at; i++)
+    {
+        if (table[i].present && table[i].frame_addr != zero_frame)
+        {
+            count++;
+        }
+    }
+    return count;
+}
+
+/**
+ * @brief 范围是否整个位于区域内
+ */
+static bool_t range_in_region(vmm_region_t *region, uint32_t base)
+{
+    return base >= region->start && region->end - base >= LARGE_PAGE_SIZE;
+}
+
+bool_t thp_handle_fault(vmm_region_t *region, uint32_t faulting_addr)
+{
+    uint32_t base = LARGE_PAGE_ALIGN_DOWN(faulting_addr);
+    if (!range_in_region(region, base) || count_real_pages(base, 1) != 0)
+    {
+        return false;
+    }
+
+    uint32_t phys = pmm_alloc_contiguous(LARGE_PAGE_PAGES, LARGE_PAGE_PAGES);
+    if (phys == 0)
+    {
+        thp_stats.fault_fallbacks++;
+        return false;
+    }
+
+    // 与 4KB 匿名页一样，新内存必须全 0
+    for (uint32_t i = 0; i < LARGE_PAGE_PAGES; i++)
+    {
+        kmap_zero_frame(phys + i * PAGE_SIZE);
+    }
+
+    if (!vmm_map_large_page(base, phys, PAGE_KERNEL_FLAGS))
+    {
+        pmm_free_contiguous(phys, LARGE_PAGE_PAGES);
+        thp_stats.fault_fallbacks++;
+        return false;
+    }
+
+    thp_stats.fault_promotions++;
+    return true;
+}
+
+/**
+ * @brief 把一个密集填充的页表折叠为大页
+ */
+static bool_t collapse_range(uint32_t base)
+{
+    uint32_t phys = pmm_alloc_contiguous(LARGE_PAGE_PAGES, LARGE_PAGE_PAGES);
+    if (phys == 0)
+    {
+        thp_stats.collapse_fallbacks++;
+        return false;
+    }
+
+    // 复制期间任何人都不能写这个范围：单核下关中断即可
+    uint32_t eflags = cpu_save_flags_and_cli();
+
+    page_table_entry_t *table = vmm_get_pte(base);
+    uint32_t zero_frame = vmm_zero_page_phys() >> PAGE_SHIFT;
+    for (uint32_t i = 0; i < LARGE_PAGE_PAGES; i++)
+    {
+        uint32_t dst = phys + i * PAGE_SIZE;
+        if (table[i].present && table[i].frame_addr != zero_frame)
+        {
+            kmap_copy_frame(dst, table[i].frame_addr << 12);
+            pmm_free_page(table[i].frame_addr << 12);
+        }
+        else
+        {
+            kmap_zero_frame(dst);
+        }
+        // 旧页已复制并归还；在大页生效前中断关闭，没有人会访问这个范围
+        table[i] = (page_table_entry_t){0};
+    }
+
+    bool_t ok = vmm_map_large_page(base, phys, PAGE_KERNEL_FLAGS);
+    ASSERT(ok);
+
+    set_eflags(eflags);
+    thp_stats.collapses++;
+    return true;
+}
+
+/**
+ * @brief 把游标移到下一个 THP 区域的起始处
+ * @return true 找到了 THP 区域
+ */
+static bool_t collapse_next_region(void)
+{
+    for (uint32_t n = 0; n < VMM_MAX_REGIONS; n++)
+    {
+        collapse_region = (collapse_region + 1) % VMM_MAX_REGIONS;
+        vmm_region_t *region = vmm_region_get(collapse_region);
+        if (region != NULL && (region->flags & VMM_REGION_THP))
+        {
+            collapse_addr = ALIGN_UP(region->start, LARGE_PAGE_SIZE);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t thp_collapse_scan(uint32_t max_ranges)
+{
+    for (uint32_t n = 0; n < max_ranges; n++)
+    {
+        vmm_region_t *region = vmm_region_get(collapse_region);
+        if (region == NULL || !(region->flags & VMM_REGION_THP) || !range_in_region(region, collapse_addr))
+        {
+            if (!collapse_next_region())
+            {
+                return 0;
+            }
+            region = vmm_region_get(collapse_region);
+            if (!range_in_region(region, collapse_addr))
+            {
+                continue; // 区域小于一个大页
+            }
+        }
+
+        uint32_t base = collapse_addr;
+        collapse_addr += LARGE_PAGE_SIZE;
+
+        if (vmm_get_pte(base) == NULL)
+        {
+            continue; // 已经是大页
+        }
+        if (count_real_pages(base, LARGE_PAGE_PAGES) >= THP_COLLAPSE_MIN_PTES && collapse_range(base))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void thp_khugepaged(void)
+{
+    uint32_t now = getTick();
+    if (now - collapse_last_tick < THP_COLLAPSE_INTERVAL)
+    {
+        return;
+    }
+    collapse_last_tick = now;
+    thp_collapse_scan(THP_COLLAPSE_SCAN_RANGES);
+}
+
+void thp_dump(void)
+{
+    vga_printf("========== THP ==========\n");
+    vga_printf("fault promotions   = %d\n", thp_stats.fault_promotions);
+    vga_printf("fault fallbacks    = %d\n", thp_stats.fault_fallbacks);
+    vga_printf("collapses          = %d\n", thp_stats.collapses);
+    vga_printf("collapse fallbacks = %d\n", thp_stats.collapse_fallbacks);
+    vga_printf("splits             = %d\n", thp_stats.splits);
+    vga_printf("=========================\n");
+}
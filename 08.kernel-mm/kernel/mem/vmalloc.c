@@ -0,0 +1,156 @@
+/**
+ * @file vmalloc.c
+ * @brief 页粒度内核虚拟内存分配器实现
+ */
+
+#include "vmalloc.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "yieldlock.h"
+#include "vga.h"
+#include "string.h"
+
+/**
+ * @brief 窗口的虚拟页位图，每一位对应一个虚拟页（1 = 已分配）
+ */
+static uint32_t vmalloc_bitmap[VMALLOC_PAGES / 32];
+
+/**
+ * @brief 下一次搜索的起点（Next Fit），避免每次都从窗口头部扫描
+ */
+static uint32_t vmalloc_hint = 0;
+
+static uint32_t vmalloc_used = 0;
+
+static yieldlock_t vmalloc_lock;
+
+static inline bool_t va_test(uint32_t page)
+{
+    return vmalloc_bitmap[page / 32] & (1 << (page % 32));
+}
+
+static inline void va_set(uint32_t page)
+{
+    vmalloc_bitmap[page / 32] |= (1 << (page % 32));
+}
+
+static inline void va_clear(uint32_t page)
+{
+    vmalloc_bitmap[page / 32] &= ~(1 << (page % 32));
+}
+
+/**
+ * @brief 从 from 开始查找 pages 个连续空闲虚拟页
+ * @return uint32_t 起始页下标；找不到时返回 VMALLOC_PAGES
+ */
+static uint32_t find_free_run(uint32_t from, uint32_t pages, uint32_t align_pages)
+{
+    uint32_t start = ALIGN_UP(from, align_pages);
+    while (start + pages <= VMALLOC_PAGES)
+    {
+        uint32_t i = 0;
+        while (i < pages && !va_test(start + i))
+        {
+            i++;
+        }
+        if (i == pages)
+        {
+            return start;
+        }
+        start = ALIGN_UP(start + i + 1, align_pages);
+    }
+    return VMALLOC_PAGES;
+}
+
+/**
+ * @brief 解除 [first, first + pages) 的映射，归还物理页和虚拟页
+ */
+static void release_pages(uint32_t first, uint32_t pages)
+{
+    for (uint32_t p = first; p < first + pages; p++)
+    {
+        uint32_t va = VMALLOC_START + p * PAGE_SIZE;
+        uint32_t pa = vmm_get_phys_addr(va);
+        if (pa != 0)
+        {
+            vmm_unmap_page(va);
+            pmm_free_page(pa);
+        }
+        va_clear(p);
+    }
+}
+
+void vmalloc_init(void)
+{
+    yieldlock_init(&vmalloc_lock);
+    memset(vmalloc_bitmap, 0, sizeof(vmalloc_bitmap));
+    vmalloc_hint = 0;
+    vmalloc_used = 0;
+    // 窗口中的页总是先映射后使用，这里的缺页一定是释放后使用
+    vmm_region_register("vmalloc", VMALLOC_START, VMALLOC_END, VMM_REGION_TRACK_IDLE);
+}
+
+void *vmalloc_pages(uint32_t pages, uint32_t align_pages)
+{
+    if (pages == 0 || align_pages == 0 || (align_pages & (align_pages - 1)) != 0)
+    {
+        return NULL;
+    }
+
+    yieldlock_lock(&vmalloc_lock);
+
+    uint32_t first = find_free_run(vmalloc_hint, pages, align_pages);
+    if (first == VMALLOC_PAGES && vmalloc_hint != 0)
+    {
+        first = find_free_run(0, pages, align_pages);
+    }
+    if (first == VMALLOC_PAGES)
+    {
+        yieldlock_unlock(&vmalloc_lock);
+        vga_printf("vmalloc: out of virtual space (%d pages).\n", pages);
+        return NULL;
+    }
+
+    for (uint32_t p = first; p < first + pages; p++)
+    {
+        va_set(p);
+        if (!vmm_alloc_and_map_page(VMALLOC_START + p * PAGE_SIZE, PAGE_KERNEL_FLAGS))
+        {
+            // 物理内存耗尽：回滚已经建立的映射
+            release_pages(first, p + 1 - first);
+            yieldlock_unlock(&vmalloc_lock);
+            return NULL;
+        }
+    }
+
+    vmalloc_hint = first + pages;
+    vmalloc_used += pages;
+    yieldlock_unlock(&vmalloc_lock);
+    return (void *)(VMALLOC_START + first * PAGE_SIZE);
+}
+
+void vfree_pages(void *addr, uint32_t pages)
+{
+    if (addr == NULL || pages == 0)
+    {
+        return;
+    }
+    ASSERT(is_vmalloc_addr(addr) && ((uint32_t)addr & 0xFFF) == 0);
+
+    uint32_t first = ((uint32_t)addr - VMALLOC_START) / PAGE_SIZE;
+    ASSERT(first + pages <= VMALLOC_PAGES);
+
+    yieldlock_lock(&vmalloc_lock);
+    release_pages(first, pages);
+    vmalloc_used -= pages;
+    if (first < vmalloc_hint)
+    {
+        vmalloc_hint = first;
+    }
+    yieldlock_unlock(&vmalloc_lock);
+}
+
+uint32_t vmalloc_used_pages(void)
+{
+    return vmalloc_used;
+}
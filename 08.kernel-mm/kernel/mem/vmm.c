@@ -8,6 +8,8 @@
 #include "vga.h"
 #include "string.h"
 #include "ports.h"
+#include "kmap.h"
+#include "thp.h"
 
 // ====================================================================
 // 内部状态与辅助函数
@@ -18,6 +20,38 @@
  */
 static uint32_t kernel_directory_phys_addr;
 
+/**
+ * @brief 已注册的虚拟内存区域表
+ */
+static vmm_region_t vmm_regions[VMM_MAX_REGIONS];
+static uint32_t vmm_region_count = 0;
+
+/**
+ * @brief 共享零页
+ * @note 位于内核 .bss 段，在 vmm_init 中显式清零后永远不再被写入。
+ *       匿名区域的读缺页都以只读方式映射到这一个物理页上。
+ */
+static uint8_t zero_page[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+static uint32_t zero_page_phys;
+
+/**
+ * @brief CPU 是否支持 PAT (CPUID.01H:EDX[16])
+ */
+static bool_t pat_supported = false;
+
+/**
+ * @brief ioremap 窗口的页位图，每一位对应窗口中的一个虚拟页
+ */
+#define IOREMAP_PAGES ((IOREMAP_END - IOREMAP_START) / PAGE_SIZE)
+static uint32_t ioremap_bitmap[IOREMAP_PAGES / 32];
+
+/**
+ * @brief 被大页替换下来的页表的物理地址，按页目录下标索引
+ * @note 内核空间的页表由引导程序预先分配，提升为大页时不能丢弃，
+ *       拆分时要重新挂回同一个页表。
+ */
+static uint32_t large_page_saved_table[1024];
+
 /**
  * @brief 获取一个虚拟地址对应的页表项
  *
@@ -41,6 +75,12 @@ static page_table_entry_t *get_page(uint32_t virt_addr)
         return NULL; // 页表不存在
     }
 
+    // 大页没有页表；此时自映射窗口中对应的“页表”其实是大页的数据
+    if (pde_is_large(pde))
+    {
+        return NULL;
+    }
+
     // 【自映射核心】计算页表的虚拟地址
     // 无论 current_directory 指向哪个页目录，页表区域总是被映射到 PAGE_TABLES_VIRTUAL_ADDR
     page_table_t *page_table_virt = (page_table_t *)(PAGE_TABLES_VIRTUAL_ADDR + page_dir_idx * PAGE_SIZE);
@@ -57,6 +97,103 @@ static inline void invalidate_page(uint32_t addr)
     asm volatile("invlpg (%0)" : : "r"(addr) : "memory");
 }
 
+static inline void cpuid(uint32_t leaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx)
+{
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(0));
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value)
+{
+    asm volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+/**
+ * @brief 刷新整个 TLB（重新加载 CR3）
+ */
+static inline void flush_tlb_all(void)
+{
+    uint32_t cr3;
+    asm volatile("mov %%cr3, %0" : "=r"(cr3));
+    asm volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+}
+
+/**
+ * @brief 编程 IA32_PAT，使 PAT 位选中写合并 (WC)
+ *
+ * 按 Intel SDM 的要求，修改 PAT 前后都要回写并失效缓存、刷新 TLB，
+ * 防止同一物理页残留旧缓存类型的缓存行或 TLB 条目。
+ */
+static void pat_init(void)
+{
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(1, &eax, &ebx, &ecx, &edx);
+    pat_supported = (edx & (1 << 16)) != 0;
+    if (!pat_supported)
+    {
+        return;
+    }
+
+    uint64_t pat = PAT_ENTRY(0, PAT_TYPE_WB) | PAT_ENTRY(1, PAT_TYPE_WT) |
+                   PAT_ENTRY(2, PAT_TYPE_UC_MINUS) | PAT_ENTRY(3, PAT_TYPE_UC) |
+                   PAT_ENTRY(4, PAT_TYPE_WC) | PAT_ENTRY(5, PAT_TYPE_WT) |
+                   PAT_ENTRY(6, PAT_TYPE_UC_MINUS) | PAT_ENTRY(7, PAT_TYPE_UC);
+
+    asm volatile("wbinvd" : : : "memory");
+    flush_tlb_all();
+    wrmsr(MSR_IA32_PAT, pat);
+    asm volatile("wbinvd" : : : "memory");
+    flush_tlb_all();
+}
+
+/**
+ * @brief 在 ioremap 窗口中找到并占用连续 pages 个虚拟页
+ *
+ * @return uint32_t 起始虚拟地址；找不到时返回 0
+ */
+static uint32_t ioremap_alloc_va(uint32_t pages)
+{
+    uint32_t run = 0;
+    for (uint32_t i = 0; i < IOREMAP_PAGES; i++)
+    {
+        if (ioremap_bitmap[i / 32] & (1 << (i % 32)))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == pages)
+        {
+            uint32_t first = i + 1 - pages;
+            for (uint32_t p = first; p <= i; p++)
+            {
+                ioremap_bitmap[p / 32] |= (1 << (p % 32));
+            }
+            return IOREMAP_START + first * PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 为匿名区域的写缺页分配一个新物理页，映射为可写并清零
+ *
+ * @param aligned_addr 按页对齐的故障地址
+ * @return true 成功
+ * @return false 物理内存耗尽
+ */
+static bool_t anon_map_fresh_page(uint32_t aligned_addr)
+{
+    uint32_t frame = pmm_alloc_page();
+    if (frame == 0)
+    {
+        return false;
+    }
+    // 读者此前可能已经通过零页看到过这一页的内容（全 0），
+    // 新页必须同样是全 0，否则写入一个字节会“改变”其余字节。
+    // 通过临时映射清零后再挂到故障地址上，其他路径永远看不到未清零的内容。
+    kmap_zero_frame(frame);
+    return vmm_map_page(aligned_addr, frame, PAGE_KERNEL_FLAGS);
+}
+
 // ====================================================================
 // VMM 公共接口实现
 // ====================================================================
@@ -66,6 +203,29 @@ void vmm_init(void)
     // 1. 设置 VMM 的内部状态
     kernel_directory_phys_addr = KERNEL_PAGE_DIR_PHY;
 
+    // 2. 准备共享零页，并打开 CR0.WP，使内核态写只读页（零页）也能触发 Page Fault
+    memset(zero_page, 0, PAGE_SIZE);
+    zero_page_phys = vmm_get_phys_addr((uint32_t)zero_page);
+
+    uint32_t cr0;
+    asm volatile("mov %%cr0, %0" : "=r"(cr0));
+    cr0 |= CR0_WP;
+    asm volatile("mov %0, %%cr0" : : "r"(cr0));
+
+    // 打开 CR4.PSE，允许透明大页
+    uint32_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    cr4 |= CR4_PSE;
+    asm volatile("mov %0, %%cr4" : : "r"(cr4));
+
+    // 3. 准备临时映射窗口
+    kmap_init();
+
+    // 4. 编程 PAT，并把 VGA 文本缓冲区改为写合并，屏幕输出不再逐字节穿透缓存
+    pat_init();
+    vmm_region_register("ioremap", IOREMAP_START, IOREMAP_END, 0);
+    vmm_set_cache_type((uint32_t)VGA_MEMORY, VGA_WIDTH * VGA_HEIGHT * 2, VMM_CACHE_WC);
+
     // 【新增】注册 Page Fault (中断 14) 处理程序
     register_interrupt_handler(INT_PAGE_FAULT, vmm_page_fault_handler);
 
@@ -73,10 +233,159 @@ void vmm_init(void)
     vga_printf("    Page Dir @ 0x%x (Virt: 0x%x)\n", kernel_directory_phys_addr, PAGE_DIR_VIRTUAL);
     vga_printf("    Page Tables @ 0x%x\n", PAGE_TABLES_VIRTUAL_ADDR);
     vga_printf("    Page Fault handler registered for on-demand paging.\n");
+    vga_printf("    Shared zero page @ 0x%x\n", zero_page_phys);
+    vga_printf("    PAT %s\n", pat_supported ? "enabled (WB/WT/UC/WC)" : "not supported, WC falls back to UC");
+}
+
+uint32_t vmm_cache_flags(vmm_cache_type_t type)
+{
+    switch (type)
+    {
+    case VMM_CACHE_WT:
+        return PAGE_CACHE_WT;
+    case VMM_CACHE_UC:
+        return PAGE_CACHE_UC;
+    case VMM_CACHE_WC:
+        return pat_supported ? PAGE_CACHE_WC : PAGE_CACHE_UC;
+    case VMM_CACHE_WB:
+    default:
+        return PAGE_CACHE_WB;
+    }
+}
+
+void vmm_set_cache_type(uint32_t virt_addr, uint32_t size, vmm_cache_type_t type)
+{
+    uint32_t cache_flags = vmm_cache_flags(type);
+    uint32_t end = PAGE_ALIGN_UP(virt_addr + size);
+    for (uint32_t va = PAGE_ALIGN_DOWN(virt_addr); va < end; va += PAGE_SIZE)
+    {
+        page_table_entry_t *page = get_page(va);
+        if (page == NULL || !page->present)
+        {
+            continue;
+        }
+        page->writethrough = (cache_flags & PAGE_WRITETHROUGH) ? 1 : 0;
+        page->cache_disable = (cache_flags & PAGE_CACHE_DISABLE) ? 1 : 0;
+        page->pat = (cache_flags & PAGE_PAT) ? 1 : 0;
+        invalidate_page(va);
+    }
+    // 旧缓存类型下的缓存行可能仍然存在，回写并失效
+    asm volatile("wbinvd" : : : "memory");
+}
+
+void *ioremap(uint32_t paddr, uint32_t size, vmm_cache_type_t cache_type)
+{
+    if (size == 0)
+    {
+        return NULL;
+    }
+
+    uint32_t offset = paddr & 0xFFF;
+    uint32_t pages = PAGE_ALIGN_UP(offset + size) / PAGE_SIZE;
+    uint32_t vaddr = ioremap_alloc_va(pages);
+    if (vaddr == 0)
+    {
+        vga_printf("VMM: ioremap window exhausted (0x%x, %d bytes).\n", paddr, size);
+        return NULL;
+    }
+
+    uint32_t flags = PAGE_KERNEL_FLAGS | vmm_cache_flags(cache_type);
+    uint32_t base = PAGE_ALIGN_DOWN(paddr);
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        vmm_map_page(vaddr + i * PAGE_SIZE, base + i * PAGE_SIZE, flags);
+    }
+    return (void *)(vaddr + offset);
+}
+
+void iounmap(void *vaddr, uint32_t size)
+{
+    uint32_t va = (uint32_t)vaddr;
+    if (va < IOREMAP_START || va >= IOREMAP_END || size == 0)
+    {
+        return;
+    }
+
+    uint32_t offset = va & 0xFFF;
+    uint32_t pages = PAGE_ALIGN_UP(offset + size) / PAGE_SIZE;
+    uint32_t first = (PAGE_ALIGN_DOWN(va) - IOREMAP_START) / PAGE_SIZE;
+    for (uint32_t p = first; p < first + pages && p < IOREMAP_PAGES; p++)
+    {
+        // 只解除映射，不释放物理页：设备内存不归 PMM 管理
+        vmm_unmap_page(IOREMAP_START + p * PAGE_SIZE);
+        ioremap_bitmap[p / 32] &= ~(1 << (p % 32));
+    }
+}
+
+bool_t vmm_region_register(const char *name, uint32_t start, uint32_t end, uint32_t flags)
+{
+    if ((start & 0xFFF) != 0 || (end & 0xFFF) != 0 || start >= end)
+    {
+        return false;
+    }
+    if (vmm_region_count >= VMM_MAX_REGIONS)
+    {
+        vga_printf("VMM: Region table full, cannot register %s.\n", name);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < vmm_region_count; i++)
+    {
+        vmm_region_t *r = &vmm_regions[i];
+        if (start < r->end && r->start < end)
+        {
+            vga_printf("VMM: Region %s overlaps %s.\n", name, r->name);
+            return false;
+        }
+    }
+
+    vmm_region_t *region = &vmm_regions[vmm_region_count++];
+    region->name = name;
+    region->start = start;
+    region->end = end;
+    region->flags = flags;
+    return true;
+}
+
+vmm_region_t *vmm_region_find(uint32_t virt_addr)
+{
+    for (uint32_t i = 0; i < vmm_region_count; i++)
+    {
+        vmm_region_t *r = &vmm_regions[i];
+        if (virt_addr >= r->start && virt_addr < r->end)
+        {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+vmm_region_t *vmm_region_get(uint32_t index)
+{
+    return index < vmm_region_count ? &vmm_regions[index] : NULL;
+}
+
+uint32_t vmm_zero_page_phys(void)
+{
+    return zero_page_phys;
+}
+
+static page_table_entry_t make_pte(uint32_t phys_addr, uint32_t flags)
+{
+    page_table_entry_t entry = {0};
+    entry.frame_addr = phys_addr >> 12;
+    entry.present = (flags & PAGE_PRESENT) ? 1 : 0;
+    entry.rw = (flags & PAGE_RW) ? 1 : 0;
+    entry.user = (flags & PAGE_USER) ? 1 : 0;
+    entry.writethrough = (flags & PAGE_WRITETHROUGH) ? 1 : 0;
+    entry.cache_disable = (flags & PAGE_CACHE_DISABLE) ? 1 : 0;
+    entry.pat = (flags & PAGE_PAT) ? 1 : 0;
+    return entry;
 }
 
 bool_t vmm_map_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
 {
+    vmm_split_large_page(virt_addr);
     page_table_entry_t *page = get_page(virt_addr);
     if (page == NULL)
     {
@@ -84,13 +393,8 @@ bool_t vmm_map_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
         return false; // 页表不存在，映射失败
     }
 
-    // 设置页表项
-    page->frame_addr = phys_addr >> 12;
-    page->present = (flags & PAGE_PRESENT) ? 1 : 0;
-    page->rw = (flags & PAGE_RW) ? 1 : 0;
-    page->user = (flags & PAGE_USER) ? 1 : 0;
-    page->writethrough = (flags & PAGE_WRITETHROUGH) ? 1 : 0;
-    page->cache_disable = (flags & PAGE_CACHE_DISABLE) ? 1 : 0;
+    // 在局部变量中组装页表项，再一次性写入，避免页表项处于“半更新”状态
+    *page = make_pte(phys_addr, flags);
 
     // 刷新 TLB
     invalidate_page(virt_addr);
@@ -98,6 +402,121 @@ bool_t vmm_map_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
     return true;
 }
 
+bool_t vmm_map_range(uint32_t virt_addr, const uint32_t *frames, uint32_t count, uint32_t flags)
+{
+    bool_t need_flush = false;
+    bool_t ok = true;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (frames[i] == 0)
+        {
+            continue;
+        }
+        uint32_t va = virt_addr + i * PAGE_SIZE;
+        vmm_split_large_page(va);
+        page_table_entry_t *page = get_page(va);
+        if (page == NULL)
+        {
+            vga_printf("VMM: Failed to map page 0x%x. Page table not present.\n", va);
+            ok = false;
+            break;
+        }
+        // 原来存在的映射（例如只读的共享零页）可能已经在 TLB 里
+        if (page->present)
+        {
+            need_flush = true;
+        }
+        *page = make_pte(frames[i], flags);
+    }
+
+    if (need_flush)
+    {
+        flush_tlb_all();
+    }
+    return ok;
+}
+
+page_table_entry_t *vmm_get_pte(uint32_t virt_addr)
+{
+    return get_page(virt_addr);
+}
+
+page_directory_entry_t *vmm_get_pde(uint32_t virt_addr)
+{
+    return &((page_directory_t *)PAGE_DIR_VIRTUAL)->entries[virt_addr >> 22];
+}
+
+bool_t vmm_map_large_page(uint32_t virt_addr, uint32_t phys_addr, uint32_t flags)
+{
+    ASSERT((virt_addr & (LARGE_PAGE_SIZE - 1)) == 0);
+    ASSERT((phys_addr & (LARGE_PAGE_SIZE - 1)) == 0);
+
+    uint32_t pde_idx = virt_addr >> 22;
+    page_directory_entry_t *pde = vmm_get_pde(virt_addr);
+    if (!pde->present || pde_is_large(pde))
+    {
+        return false;
+    }
+
+    // 原页表中只允许存在共享零页的映射，它们被大页（同样是全 0 的新内存）取代
+    page_table_t *table = (page_table_t *)(PAGE_TABLES_VIRTUAL_ADDR + pde_idx * PAGE_SIZE);
+    uint32_t zero_frame = zero_page_phys >> 12;
+    for (uint32_t i = 0; i < 1024; i++)
+    {
+        if (table->entries[i].present && table->entries[i].frame_addr != zero_frame)
+        {
+            return false;
+        }
+    }
+    memset(table, 0, sizeof(page_table_t));
+
+    large_page_saved_table[pde_idx] = pde->frame_addr << 12;
+
+    *(uint32_t *)pde = (phys_addr & 0xFFC00000) | PAGE_LARGE | PAGE_PRESENT | (flags & PAGE_RW);
+
+    // 旧的 4KB 条目与自映射窗口中该页表的条目都已失效
+    flush_tlb_all();
+    return true;
+}
+
+void vmm_split_large_page(uint32_t virt_addr)
+{
+    uint32_t pde_idx = virt_addr >> 22;
+    page_directory_entry_t *pde = vmm_get_pde(virt_addr);
+    if (!pde_is_large(pde))
+    {
+        return;
+    }
+
+    uint32_t table_phys = large_page_saved_table[pde_idx];
+    ASSERT(table_phys != 0);
+
+    // 页表此时不在任何映射中，通过临时映射填写
+    page_table_t *table = (page_table_t *)kmap_atomic(table_phys);
+    uint32_t base_frame = pde->frame_addr;
+    for (uint32_t i = 0; i < 1024; i++)
+    {
+        page_table_entry_t entry = {0};
+        entry.frame_addr = base_frame + i;
+        entry.present = 1;
+        entry.rw = pde->rw;
+        entry.avail = pde->avail;
+        table->entries[i] = entry;
+    }
+    kunmap_atomic(table);
+
+    page_directory_entry_t entry = {0};
+    entry.frame_addr = table_phys >> 12;
+    entry.present = 1;
+    entry.rw = 1;
+    entry.user = 1;
+    *pde = entry;
+    large_page_saved_table[pde_idx] = 0;
+
+    flush_tlb_all();
+    thp_stats.splits++;
+}
+
 bool_t vmm_alloc_and_map_page(uint32_t virt_addr, uint32_t flags)
 {
     uint32_t new_phys_page = pmm_alloc_page();
@@ -109,6 +528,7 @@ bool_t vmm_alloc_and_map_page(uint32_t virt_addr, uint32_t flags)
 
 void vmm_unmap_page(uint32_t virt_addr)
 {
+    vmm_split_large_page(virt_addr);
     page_table_entry_t *page = get_page(virt_addr);
     if (page == NULL || !page->present)
     {
@@ -122,8 +542,37 @@ void vmm_unmap_page(uint32_t virt_addr)
     invalidate_page(virt_addr);
 }
 
+uint32_t vmm_release_range(uint32_t virt_addr, uint32_t pages)
+{
+    ASSERT((virt_addr & 0xFFF) == 0);
+    uint32_t released = 0;
+    for (uint32_t i = 0; i < pages; i++)
+    {
+        uint32_t va = virt_addr + i * PAGE_SIZE;
+        uint32_t pa = vmm_get_phys_addr(va);
+        if (pa == 0)
+        {
+            continue;
+        }
+        vmm_unmap_page(va);
+        // 只读缺页映射的是共享零页，它不属于这段地址，不能归还
+        if ((pa & 0xFFFFF000) != zero_page_phys)
+        {
+            pmm_free_page(pa & 0xFFFFF000);
+            released++;
+        }
+    }
+    return released;
+}
+
 uint32_t vmm_get_phys_addr(uint32_t virt_addr)
 {
+    page_directory_entry_t *pde = vmm_get_pde(virt_addr);
+    if (pde_is_large(pde))
+    {
+        return (pde->frame_addr << 12) + (virt_addr & (LARGE_PAGE_SIZE - 1));
+    }
+
     page_table_entry_t *page = get_page(virt_addr);
     if (page == NULL || !page->present)
     {
@@ -138,6 +587,33 @@ void vmm_switch_page_directory(uint32_t new_directory_phys_addr)
     asm volatile("mov %0, %%cr3" : : "r"(new_directory_phys_addr));
 }
 
+uint32_t vmm_create_page_directory(void)
+{
+    uint32_t pd_phys = pmm_alloc_page();
+    if (pd_phys == 0)
+    {
+        return 0;
+    }
+
+    // 新页目录不在任何地址空间中，通过临时映射填写，不占用内核虚拟地址
+    page_directory_t *pd = (page_directory_t *)kmap_atomic(pd_phys);
+    page_directory_t *current = (page_directory_t *)PAGE_DIR_VIRTUAL;
+    uint32_t kernel_first_pde = DIRECT_MAP_BASE >> 22;
+
+    // 用户空间为空，内核空间与当前页目录共享同一组页表
+    memset(pd, 0, kernel_first_pde * sizeof(page_directory_entry_t));
+    for (uint32_t i = kernel_first_pde; i < 1024; i++)
+    {
+        pd->entries[i] = current->entries[i];
+    }
+
+    // 自映射项指向新页目录自身
+    pd->entries[PAGE_TABLES_VIRTUAL_ADDR >> 22].frame_addr = pd_phys >> 12;
+
+    kunmap_atomic(pd);
+    return pd_phys;
+}
+
 uint32_t vmm_get_current_directory_phys_addr(void)
 {
     // 【最准确的方式】直接从 CR3 寄存器读取当前页目录的物理地址
@@ -163,7 +639,50 @@ void vmm_page_fault_handler(interrupt_frame_t *frame)
     // 2. 对齐地址到页边界
     uint32_t aligned_addr = PAGE_ALIGN_DOWN(faulting_addr);
 
-    if (!vmm_alloc_and_map_page(aligned_addr, PAGE_KERNEL_FLAGS)) {
+    vmm_region_t *region = vmm_region_find(faulting_addr);
+    if (region == NULL)
+    {
+        // 未注册区域：沿用旧行为，直接分配物理页
+        if (!vmm_alloc_and_map_page(aligned_addr, PAGE_KERNEL_FLAGS))
+        {
+            vga_printf("Page fault: Out of memory.");
+            PANIC();
+        }
+        return;
+    }
+
+    if (!(region->flags & VMM_REGION_ANON))
+    {
+        vga_printf("\n!!!!! KERNEL PAGE FAULT in region %s !!!!!\n", region->name);
+        vga_printf("Faulting address: 0x%x, error code: 0x%x\n", faulting_addr, frame->err_code);
+        PANIC();
+    }
+
+    // 3. 匿名区域：读缺页只映射共享零页，真正的物理页推迟到第一次写
+    if (!(frame->err_code & PF_WRITE))
+    {
+        vmm_map_page(aligned_addr, zero_page_phys, PAGE_KERNEL_RO_FLAGS);
+        return;
+    }
+
+    // 4. 写缺页：页不存在，或者是对共享零页的写（写时分配）
+    if ((frame->err_code & PF_PRESENT) &&
+        PAGE_ALIGN_DOWN(vmm_get_phys_addr(aligned_addr)) != zero_page_phys)
+    {
+        vga_printf("\n!!!!! KERNEL PAGE FAULT (write to read-only page) !!!!!\n");
+        vga_printf("Faulting address: 0x%x\n", faulting_addr);
+        PANIC();
+    }
+
+    // 5. 透明大页：声明会被用满的区域中，整个 4MB 范围尚未使用时直接映射一个大页；
+    //    其它 THP 区域只由 khugepaged 在页表足够密集后折叠
+    if ((region->flags & VMM_REGION_THP_FAULT) && thp_handle_fault(region, faulting_addr))
+    {
+        return;
+    }
+
+    if (!anon_map_fresh_page(aligned_addr))
+    {
         vga_printf("Page fault: Out of memory.");
         PANIC();
     }
@@ -1,14 +1,19 @@
 #include "yieldlock.h"
-
-extern uint32_t atomic_exchange(volatile uint32_t *dst, uint32_t src);
+#include "lock.h"
 
 void yieldlock_init(yieldlock_t *splock)
 {
     splock->lock = LOCKED_NO;
+    splock->contended = 0;
 }
 
 void yieldlock_lock(yieldlock_t *splock)
 {
+    if (atomic_exchange(&splock->lock, LOCKED_YES) == LOCKED_NO)
+    {
+        return;
+    }
+    atomic_inc(&splock->contended);
     while (atomic_exchange(&splock->lock, LOCKED_YES) != LOCKED_NO)
     {
         // schedule_thread_yield();